@@ -0,0 +1,105 @@
+#include "arena.h"
+
+#include "heap.h"
+
+#include <stdint.h>
+
+typedef struct arena_block_t
+{
+	struct arena_block_t* next;
+	size_t size;
+} arena_block_t;
+
+typedef struct arena_t
+{
+	heap_t* heap;
+	size_t block_size;
+	arena_block_t* first;
+	arena_block_t* current;
+	size_t offset;
+} arena_t;
+
+static void* block_alloc(arena_t* arena, size_t size, size_t alignment)
+{
+	uintptr_t base = (uintptr_t)(arena->current + 1);
+	uintptr_t address = (base + arena->offset + (alignment - 1)) & ~(uintptr_t)(alignment - 1);
+	if (address + size > base + arena->current->size)
+	{
+		return NULL;
+	}
+	arena->offset = address + size - base;
+	return (void*)address;
+}
+
+arena_t* arena_create(heap_t* heap, size_t block_size)
+{
+	arena_t* arena = heap_alloc(heap, sizeof(arena_t), 8);
+	if (!arena)
+	{
+		return NULL;
+	}
+	arena->heap = heap;
+	arena->block_size = block_size;
+	arena->first = NULL;
+	arena->current = NULL;
+	arena->offset = 0;
+	return arena;
+}
+
+void arena_destroy(arena_t* arena)
+{
+	arena_block_t* block = arena->first;
+	while (block)
+	{
+		arena_block_t* next = block->next;
+		heap_free(arena->heap, block);
+		block = next;
+	}
+	heap_free(arena->heap, arena);
+}
+
+void* arena_alloc(arena_t* arena, size_t size, size_t alignment)
+{
+	while (arena->current)
+	{
+		void* address = block_alloc(arena, size, alignment);
+		if (address)
+		{
+			return address;
+		}
+		if (!arena->current->next)
+		{
+			break;
+		}
+		arena->current = arena->current->next;
+		arena->offset = 0;
+	}
+
+	size_t block_size = __max(arena->block_size, size + alignment);
+	arena_block_t* block = heap_alloc(arena->heap, sizeof(arena_block_t) + block_size, 16);
+	if (!block)
+	{
+		return NULL;
+	}
+	block->next = NULL;
+	block->size = block_size;
+
+	if (arena->current)
+	{
+		arena->current->next = block;
+	}
+	else
+	{
+		arena->first = block;
+	}
+	arena->current = block;
+	arena->offset = 0;
+
+	return block_alloc(arena, size, alignment);
+}
+
+void arena_reset(arena_t* arena)
+{
+	arena->current = arena->first;
+	arena->offset = 0;
+}
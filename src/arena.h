@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdlib.h>
+
+// Linear Arena Allocator
+//
+// Main object, arena_t, hands out memory by bumping a pointer through
+// blocks taken from a parent heap_t. Individual allocations are never
+// freed; instead the whole arena is reset at once. Suited to transient
+// data with a common lifetime, such as everything built during one frame.
+//
+// An arena is not thread-safe. Data allocated from it may be read by other
+// threads as long as the arena is not reset until they are done with it.
+
+// Handle to an arena.
+typedef struct arena_t arena_t;
+
+typedef struct heap_t heap_t;
+
+// Creates a new arena.
+// Memory is taken from the heap in blocks of at least block_size bytes.
+// Returns NULL if the heap is out of memory.
+arena_t* arena_create(heap_t* heap, size_t block_size);
+
+// Destroys an arena and returns all of its blocks to the heap.
+void arena_destroy(arena_t* arena);
+
+// Allocates memory from an arena.
+// The memory remains valid until the next arena_reset() or arena_destroy().
+void* arena_alloc(arena_t* arena, size_t size, size_t alignment);
+
+// Releases every allocation made from an arena in constant time.
+// Blocks are kept and reused by subsequent allocations.
+void arena_reset(arena_t* arena);
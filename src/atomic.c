@@ -1,29 +1,394 @@
 #include "atomic.h"
 
-#define WIN32_LEAN_AND_MEAN
-#include <windows.h>
+#include <string.h>
 
 int atomic_increment(int* address)
 {
-	return InterlockedIncrement(address) - 1;
+	return atomic_fetch_add(address, 1, k_atomic_seq_cst);
 }
 
 int atomic_decrement(int* address)
 {
-	return InterlockedDecrement(address) + 1;
+	return atomic_fetch_add(address, -1, k_atomic_seq_cst);
 }
 
 int atomic_compare_and_exchange(int* dest, int compare, int exchange)
 {
-	return InterlockedCompareExchange(dest, exchange, compare);
+	return atomic_compare_and_exchange_explicit(dest, compare, exchange, k_atomic_seq_cst);
 }
 
 int atomic_load(int* address)
 {
-	return *(volatile int*)address;
+	return atomic_load_explicit(address, k_atomic_acquire);
 }
 
 void atomic_store(int* address, int value)
 {
-	*(volatile int*)address = value;
+	atomic_store_explicit(address, value, k_atomic_release);
+}
+
+void* atomic_load_pointer(void** address)
+{
+	return atomic_load_pointer_explicit(address, k_atomic_acquire);
+}
+
+void atomic_store_pointer(void** address, void* value)
+{
+	atomic_store_pointer_explicit(address, value, k_atomic_release);
+}
+
+void* atomic_exchange_pointer(void** address, void* exchange)
+{
+	return atomic_exchange_pointer_explicit(address, exchange, k_atomic_seq_cst);
+}
+
+void* atomic_compare_and_exchange_pointer(void** dest, void* compare, void* exchange)
+{
+	return atomic_compare_and_exchange_pointer_explicit(dest, compare, exchange, k_atomic_seq_cst);
+}
+
+uint64_t atomic_load64(uint64_t* address)
+{
+	return atomic_load64_explicit(address, k_atomic_acquire);
+}
+
+void atomic_store64(uint64_t* address, uint64_t value)
+{
+	atomic_store64_explicit(address, value, k_atomic_release);
+}
+
+uint64_t atomic_compare_and_exchange64(uint64_t* dest, uint64_t compare, uint64_t exchange)
+{
+	return atomic_compare_and_exchange64_explicit(dest, compare, exchange, k_atomic_seq_cst);
+}
+
+atomic_pair_t atomic_load_pair(atomic_pair_t* address)
+{
+	// A compare-exchange that fails returns the current value atomically; one
+	// that succeeds writes back the same value.
+	atomic_pair_t value = { 0 };
+	atomic_compare_and_exchange_pair(address, &value, value);
+	return value;
+}
+
+#if defined(_MSC_VER)
+
+// MSVC on x86 and x64. These never move a read before another read or a
+// write before another write, and their interlocked instructions are full
+// barriers, so only seq_cst stores and fences need more than a plain access
+// the compiler may not move. volatile is enough for that under the default
+// /volatile:ms.
+
+// ARM64 reorders plain accesses and defaults to /volatile:iso, so none of
+// the above holds there. It would need __ldar/__stlr and __dmb instead.
+#if !defined(_M_IX86) && !defined(_M_X64)
+#error "The MSVC atomics assume x86 or x64 ordering."
+#endif
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+int atomic_fetch_add(int* address, int value, atomic_order_t order)
+{
+	return InterlockedExchangeAdd((volatile LONG*)address, value);
+}
+
+int atomic_exchange(int* address, int exchange, atomic_order_t order)
+{
+	return InterlockedExchange((volatile LONG*)address, exchange);
+}
+
+int atomic_compare_and_exchange_explicit(int* dest, int compare, int exchange, atomic_order_t order)
+{
+	return InterlockedCompareExchange((volatile LONG*)dest, exchange, compare);
+}
+
+int atomic_load_explicit(int* address, atomic_order_t order)
+{
+	return *(volatile int*)address;
+}
+
+void atomic_store_explicit(int* address, int value, atomic_order_t order)
+{
+	if (order == k_atomic_seq_cst)
+	{
+		InterlockedExchange((volatile LONG*)address, value);
+	}
+	else
+	{
+		*(volatile int*)address = value;
+	}
+}
+
+void* atomic_load_pointer_explicit(void** address, atomic_order_t order)
+{
+	return *(void* volatile*)address;
+}
+
+void atomic_store_pointer_explicit(void** address, void* value, atomic_order_t order)
+{
+	if (order == k_atomic_seq_cst)
+	{
+		InterlockedExchangePointer(address, value);
+	}
+	else
+	{
+		*(void* volatile*)address = value;
+	}
+}
+
+void* atomic_exchange_pointer_explicit(void** address, void* exchange, atomic_order_t order)
+{
+	return InterlockedExchangePointer(address, exchange);
+}
+
+void* atomic_compare_and_exchange_pointer_explicit(void** dest, void* compare, void* exchange, atomic_order_t order)
+{
+	return InterlockedCompareExchangePointer(dest, exchange, compare);
+}
+
+uint64_t atomic_load64_explicit(uint64_t* address, atomic_order_t order)
+{
+#if defined(_WIN64)
+	return *(volatile uint64_t*)address;
+#else
+	// A compare-exchange that never succeeds returns the current value atomically.
+	return InterlockedCompareExchange64((volatile LONG64*)address, 0, 0);
+#endif
+}
+
+void atomic_store64_explicit(uint64_t* address, uint64_t value, atomic_order_t order)
+{
+#if defined(_WIN64)
+	if (order != k_atomic_seq_cst)
+	{
+		*(volatile uint64_t*)address = value;
+		return;
+	}
+#endif
+	InterlockedExchange64((volatile LONG64*)address, value);
+}
+
+uint64_t atomic_fetch_add64(uint64_t* address, uint64_t value, atomic_order_t order)
+{
+	return InterlockedExchangeAdd64((volatile LONG64*)address, value);
+}
+
+uint64_t atomic_exchange64(uint64_t* address, uint64_t exchange, atomic_order_t order)
+{
+	return InterlockedExchange64((volatile LONG64*)address, exchange);
+}
+
+uint64_t atomic_compare_and_exchange64_explicit(uint64_t* dest, uint64_t compare, uint64_t exchange, atomic_order_t order)
+{
+	return InterlockedCompareExchange64((volatile LONG64*)dest, exchange, compare);
+}
+
+bool atomic_compare_and_exchange_pair(atomic_pair_t* dest, atomic_pair_t* compare, atomic_pair_t exchange)
+{
+#if defined(_WIN64)
+	return InterlockedCompareExchange128((volatile LONG64*)dest, (LONG64)exchange.high, (LONG64)exchange.low, (LONG64*)compare) != 0;
+#else
+	LONG64 expected = (LONG64)compare->low | ((LONG64)compare->high << 32);
+	LONG64 desired = (LONG64)exchange.low | ((LONG64)exchange.high << 32);
+	LONG64 old = InterlockedCompareExchange64((volatile LONG64*)dest, desired, expected);
+	if (old == expected)
+	{
+		return true;
+	}
+	compare->low = (uintptr_t)old;
+	compare->high = (uintptr_t)(old >> 32);
+	return false;
+#endif
+}
+
+void atomic_thread_fence(atomic_order_t order)
+{
+	if (order == k_atomic_seq_cst)
+	{
+		MemoryBarrier();
+	}
+	else if (order != k_atomic_relaxed)
+	{
+		_ReadWriteBarrier();
+	}
+}
+
+void atomic_signal_fence(atomic_order_t order)
+{
+	if (order != k_atomic_relaxed)
+	{
+		_ReadWriteBarrier();
+	}
+}
+
+void atomic_light_barrier()
+{
+	_ReadWriteBarrier();
+}
+
+void atomic_heavy_barrier()
+{
+	FlushProcessWriteBuffers();
+}
+
+#else
+
+// GCC and Clang. The __atomic builtins only honor a memory order known at
+// compile time, so each order gets its own case with an enum constant the
+// operation can use. Orders an operation does not allow become seq_cst.
+
+#define ATOMIC_DISPATCH(order, name, statement, relaxed, acquire, release, acq_rel) \
+	switch (order) \
+	{ \
+	case k_atomic_relaxed: { enum { name = relaxed }; statement; } break; \
+	case k_atomic_acquire: { enum { name = acquire }; statement; } break; \
+	case k_atomic_release: { enum { name = release }; statement; } break; \
+	case k_atomic_acq_rel: { enum { name = acq_rel }; statement; } break; \
+	default: { enum { name = __ATOMIC_SEQ_CST }; statement; } break; \
+	}
+
+#define ATOMIC_LOAD_ORDERS __ATOMIC_RELAXED, __ATOMIC_ACQUIRE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST
+#define ATOMIC_STORE_ORDERS __ATOMIC_RELAXED, __ATOMIC_SEQ_CST, __ATOMIC_RELEASE, __ATOMIC_SEQ_CST
+#define ATOMIC_RMW_ORDERS __ATOMIC_RELAXED, __ATOMIC_ACQUIRE, __ATOMIC_RELEASE, __ATOMIC_ACQ_REL
+
+// Expands the order lists above into separate arguments.
+#define ATOMIC_SWITCH(order, name, statement, orders) ATOMIC_DISPATCH(order, name, statement, orders)
+
+// The failure order of a compare-exchange may not contain a release.
+#define ATOMIC_FAILURE_ORDER(success) \
+	((success) == __ATOMIC_RELEASE ? __ATOMIC_RELAXED : (success) == __ATOMIC_ACQ_REL ? __ATOMIC_ACQUIRE : (success))
+
+int atomic_fetch_add(int* address, int value, atomic_order_t order)
+{
+	ATOMIC_SWITCH(order, o, return __atomic_fetch_add(address, value, o), ATOMIC_RMW_ORDERS);
+	return 0;
+}
+
+int atomic_exchange(int* address, int exchange, atomic_order_t order)
+{
+	ATOMIC_SWITCH(order, o, return __atomic_exchange_n(address, exchange, o), ATOMIC_RMW_ORDERS);
+	return 0;
+}
+
+int atomic_compare_and_exchange_explicit(int* dest, int compare, int exchange, atomic_order_t order)
+{
+	ATOMIC_SWITCH(order, o, __atomic_compare_exchange_n(dest, &compare, exchange, false, o, ATOMIC_FAILURE_ORDER(o)), ATOMIC_RMW_ORDERS);
+	return compare;
+}
+
+int atomic_load_explicit(int* address, atomic_order_t order)
+{
+	ATOMIC_SWITCH(order, o, return __atomic_load_n(address, o), ATOMIC_LOAD_ORDERS);
+	return 0;
+}
+
+void atomic_store_explicit(int* address, int value, atomic_order_t order)
+{
+	ATOMIC_SWITCH(order, o, __atomic_store_n(address, value, o), ATOMIC_STORE_ORDERS);
+}
+
+void* atomic_load_pointer_explicit(void** address, atomic_order_t order)
+{
+	ATOMIC_SWITCH(order, o, return __atomic_load_n(address, o), ATOMIC_LOAD_ORDERS);
+	return NULL;
+}
+
+void atomic_store_pointer_explicit(void** address, void* value, atomic_order_t order)
+{
+	ATOMIC_SWITCH(order, o, __atomic_store_n(address, value, o), ATOMIC_STORE_ORDERS);
+}
+
+void* atomic_exchange_pointer_explicit(void** address, void* exchange, atomic_order_t order)
+{
+	ATOMIC_SWITCH(order, o, return __atomic_exchange_n(address, exchange, o), ATOMIC_RMW_ORDERS);
+	return NULL;
+}
+
+void* atomic_compare_and_exchange_pointer_explicit(void** dest, void* compare, void* exchange, atomic_order_t order)
+{
+	ATOMIC_SWITCH(order, o, __atomic_compare_exchange_n(dest, &compare, exchange, false, o, ATOMIC_FAILURE_ORDER(o)), ATOMIC_RMW_ORDERS);
+	return compare;
+}
+
+uint64_t atomic_load64_explicit(uint64_t* address, atomic_order_t order)
+{
+	ATOMIC_SWITCH(order, o, return __atomic_load_n(address, o), ATOMIC_LOAD_ORDERS);
+	return 0;
 }
+
+void atomic_store64_explicit(uint64_t* address, uint64_t value, atomic_order_t order)
+{
+	ATOMIC_SWITCH(order, o, __atomic_store_n(address, value, o), ATOMIC_STORE_ORDERS);
+}
+
+uint64_t atomic_fetch_add64(uint64_t* address, uint64_t value, atomic_order_t order)
+{
+	ATOMIC_SWITCH(order, o, return __atomic_fetch_add(address, value, o), ATOMIC_RMW_ORDERS);
+	return 0;
+}
+
+uint64_t atomic_exchange64(uint64_t* address, uint64_t exchange, atomic_order_t order)
+{
+	ATOMIC_SWITCH(order, o, return __atomic_exchange_n(address, exchange, o), ATOMIC_RMW_ORDERS);
+	return 0;
+}
+
+uint64_t atomic_compare_and_exchange64_explicit(uint64_t* dest, uint64_t compare, uint64_t exchange, atomic_order_t order)
+{
+	ATOMIC_SWITCH(order, o, __atomic_compare_exchange_n(dest, &compare, exchange, false, o, ATOMIC_FAILURE_ORDER(o)), ATOMIC_RMW_ORDERS);
+	return compare;
+}
+
+// The legacy __sync builtin is used because it compiles to an inline
+// cmpxchg16b (with -mcx16 on x86-64) where __atomic may call into libatomic.
+// Without -mcx16 it becomes a call to __sync_val_compare_and_swap_16, which
+// nothing defines, so fail here instead of at link time.
+#if UINTPTR_MAX > UINT32_MAX
+#if !defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_16)
+#error "atomic_pair_t needs a 16-byte compare-exchange; on x86-64 build with -mcx16."
+#endif
+typedef unsigned __int128 atomic_pair_bits_t;
+#else
+typedef uint64_t atomic_pair_bits_t;
+#endif
+
+bool atomic_compare_and_exchange_pair(atomic_pair_t* dest, atomic_pair_t* compare, atomic_pair_t exchange)
+{
+	atomic_pair_bits_t expected;
+	atomic_pair_bits_t desired;
+	memcpy(&expected, compare, sizeof(expected));
+	memcpy(&desired, &exchange, sizeof(desired));
+	atomic_pair_bits_t old = __sync_val_compare_and_swap((atomic_pair_bits_t*)dest, expected, desired);
+	if (old == expected)
+	{
+		return true;
+	}
+	memcpy(compare, &old, sizeof(old));
+	return false;
+}
+
+void atomic_thread_fence(atomic_order_t order)
+{
+	ATOMIC_SWITCH(order, o, __atomic_thread_fence(o), ATOMIC_RMW_ORDERS);
+}
+
+void atomic_signal_fence(atomic_order_t order)
+{
+	ATOMIC_SWITCH(order, o, __atomic_signal_fence(o), ATOMIC_RMW_ORDERS);
+}
+
+// There is no portable way to interrupt other processors, and membarrier on
+// Linux needs registration that can fail. Without state to remember which
+// one was used, the two halves could disagree, so both are full fences.
+void atomic_light_barrier()
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void atomic_heavy_barrier()
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+#endif
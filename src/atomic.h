@@ -1,5 +1,34 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+
+// Atomic operations
+//
+// Operations named *_explicit, and new ones like atomic_fetch_add, take a
+// memory order. The shorter forms keep their original orders: loads acquire,
+// stores release, and read-modify-write operations are sequentially
+// consistent.
+//
+// Loads accept relaxed, acquire and seq_cst; stores accept relaxed, release
+// and seq_cst. Any other order is treated as seq_cst.
+
+// Memory orders, matching C11's memory_order.
+typedef enum atomic_order_t
+{
+	// Atomic, but not ordered with other reads and writes.
+	k_atomic_relaxed,
+	// Later reads and writes stay after this one. Pairs with a release.
+	k_atomic_acquire,
+	// Earlier reads and writes stay before this one. Pairs with an acquire.
+	k_atomic_release,
+	// Both acquire and release, for read-modify-write operations.
+	k_atomic_acq_rel,
+	// Acquire and release, and all seq_cst operations happen in one order
+	// every thread agrees on.
+	k_atomic_seq_cst,
+} atomic_order_t;
+
 // Atomic operations on 32-bit integers.
 
 // Increment a number atomically.
@@ -14,16 +43,161 @@ int atomic_increment(int* address);
 //   int old_value = *address; (*address)--; return old_value;
 int atomic_decrement(int* address);
 
+// Add to a number atomically.
+// Returns the old value of the number.
+// Performs the following operation atomically:
+//   int old_value = *address; *address += value; return old_value;
+int atomic_fetch_add(int* address, int value, atomic_order_t order);
+
+// Assigns a number atomically.
+// Returns the old value of the number.
+// Performs the following operation atomically:
+//   int old_value = *address; *address = exchange; return old_value;
+int atomic_exchange(int* address, int exchange, atomic_order_t order);
+
 // Compare two numbers atomically and assign if equal.
 // Returns the old value of the number.
 // Performs the following operation atomically:
 //   int old_value = *address; if (*address == compare) *address = exchange; return old_value;
 int atomic_compare_and_exchange(int* dest, int compare, int exchange);
 
+// Same as atomic_compare_and_exchange() with the given order.
+int atomic_compare_and_exchange_explicit(int* dest, int compare, int exchange, atomic_order_t order);
+
 // Reads an integer from an address.
 // All writes that occurred before the last atomic_store to this address are flushed.
 int atomic_load(int* address);
 
+// Same as atomic_load() with the given order.
+int atomic_load_explicit(int* address, atomic_order_t order);
+
 // Writes an integer.
 // Paired with an atomic_load, can guarantee ordering and visibility.
 void atomic_store(int* address, int value);
+
+// Same as atomic_store() with the given order.
+void atomic_store_explicit(int* address, int value, atomic_order_t order);
+
+// Atomic operations on pointers.
+
+// Reads a pointer from an address.
+// Paired with atomic_exchange_pointer or atomic_compare_and_exchange_pointer,
+// can guarantee ordering and visibility.
+void* atomic_load_pointer(void** address);
+
+// Same as atomic_load_pointer() with the given order.
+void* atomic_load_pointer_explicit(void** address, atomic_order_t order);
+
+// Writes a pointer.
+// Paired with an atomic_load_pointer, can guarantee ordering and visibility.
+void atomic_store_pointer(void** address, void* value);
+
+// Same as atomic_store_pointer() with the given order.
+void atomic_store_pointer_explicit(void** address, void* value, atomic_order_t order);
+
+// Assigns a pointer atomically.
+// Returns the old value of the pointer.
+// Performs the following operation atomically:
+//   void* old_value = *address; *address = exchange; return old_value;
+void* atomic_exchange_pointer(void** address, void* exchange);
+
+// Same as atomic_exchange_pointer() with the given order.
+void* atomic_exchange_pointer_explicit(void** address, void* exchange, atomic_order_t order);
+
+// Compare two pointers atomically and assign if equal.
+// Returns the old value of the pointer.
+// Performs the following operation atomically:
+//   void* old_value = *dest; if (*dest == compare) *dest = exchange; return old_value;
+void* atomic_compare_and_exchange_pointer(void** dest, void* compare, void* exchange);
+
+// Same as atomic_compare_and_exchange_pointer() with the given order.
+void* atomic_compare_and_exchange_pointer_explicit(void** dest, void* compare, void* exchange, atomic_order_t order);
+
+// Atomic operations on 64-bit integers.
+// None of them are ever torn, even on 32-bit targets.
+
+// Reads a 64-bit integer from an address.
+uint64_t atomic_load64(uint64_t* address);
+
+// Same as atomic_load64() with the given order.
+uint64_t atomic_load64_explicit(uint64_t* address, atomic_order_t order);
+
+// Writes a 64-bit integer.
+// Paired with an atomic_load64, can guarantee ordering and visibility.
+void atomic_store64(uint64_t* address, uint64_t value);
+
+// Same as atomic_store64() with the given order.
+void atomic_store64_explicit(uint64_t* address, uint64_t value, atomic_order_t order);
+
+// Add to a 64-bit number atomically.
+// Returns the old value of the number.
+uint64_t atomic_fetch_add64(uint64_t* address, uint64_t value, atomic_order_t order);
+
+// Assigns a 64-bit number atomically.
+// Returns the old value of the number.
+uint64_t atomic_exchange64(uint64_t* address, uint64_t exchange, atomic_order_t order);
+
+// Compare two 64-bit numbers atomically and assign if equal.
+// Returns the old value of the number.
+// Performs the following operation atomically:
+//   uint64_t old_value = *dest; if (*dest == compare) *dest = exchange; return old_value;
+uint64_t atomic_compare_and_exchange64(uint64_t* dest, uint64_t compare, uint64_t exchange);
+
+// Same as atomic_compare_and_exchange64() with the given order.
+uint64_t atomic_compare_and_exchange64_explicit(uint64_t* dest, uint64_t compare, uint64_t exchange, atomic_order_t order);
+
+// Atomic operations on pairs of pointer-sized words.
+
+#if defined(_MSC_VER)
+#define ATOMIC_ALIGN(n) __declspec(align(n))
+#else
+#define ATOMIC_ALIGN(n) __attribute__((aligned(n)))
+#endif
+
+// Two words updated as one, such as a pointer and a count of its changes so
+// a compare-exchange can tell a pointer that was freed and reused from one
+// that never changed. Keep it 16-byte aligned when allocating it.
+// Always lock-free. MSVC uses InterlockedCompareExchange128 on x64 and
+// InterlockedCompareExchange64 on Win32. GCC and Clang need -mcx16 on x86-64
+// to emit cmpxchg16b; without it atomic.c fails to compile.
+typedef struct ATOMIC_ALIGN(16) atomic_pair_t
+{
+	uintptr_t low;
+	uintptr_t high;
+} atomic_pair_t;
+
+// Reads a pair from an address. Sequentially consistent.
+atomic_pair_t atomic_load_pair(atomic_pair_t* address);
+
+// Compare two pairs atomically and assign if equal. Sequentially consistent.
+// Returns true if dest was assigned. Otherwise writes the current value of
+// dest to compare and returns false.
+bool atomic_compare_and_exchange_pair(atomic_pair_t* dest, atomic_pair_t* compare, atomic_pair_t exchange);
+
+// Memory fences.
+
+// Orders this thread's reads and writes around the fence as order says, as
+// seen by other threads.
+void atomic_thread_fence(atomic_order_t order);
+
+// Same as atomic_thread_fence(), but only against signal handlers on this
+// thread; keeps the compiler from moving reads and writes, nothing more.
+void atomic_signal_fence(atomic_order_t order);
+
+// Asymmetric memory barriers.
+//
+// Two threads that each write one location and then read the other's need a
+// full barrier between the write and the read, or both may read stale values.
+// When one side runs far more often, it can use the light barrier and leave
+// the cost to the rare side, which uses the heavy one.
+
+// Light half of a barrier pair, for the side that runs often.
+// On Windows only keeps the compiler from moving reads above earlier writes;
+// elsewhere a full fence.
+void atomic_light_barrier();
+
+// Heavy half of a barrier pair, for the side that runs rarely.
+// Flushes pending writes on every processor, so a thread that has passed an
+// atomic_light_barrier has either published its earlier writes to this thread
+// or will see this thread's earlier writes in its later reads.
+void atomic_heavy_barrier();
@@ -1,16 +1,68 @@
 #include "ecs.h"
 
+#include "arena.h"
+#include "atomic.h"
 #include "debug.h"
 #include "heap.h"
+#include "thread.h"
 
 #include <string.h>
 
 enum
 {
-	k_max_component_types = 64,
-	k_max_entities = 512,
+	k_max_component_types = k_ecs_mask_bit_count,
+	k_max_archetypes = 256,
+
+	// Entity records are allocated in pages so that capacity can grow
+	// without moving existing records.
+	k_entity_page_shift = 12,
+	k_entity_page_size = 1 << k_entity_page_shift,
+
+	// Target size of one chunk of archetype storage.
+	k_chunk_size = 16 * 1024,
+	k_chunk_alignment = 64,
+
+	// Maximum number of threads that get their own command buffer.
+	k_max_command_buffers = 64,
+	k_command_arena_block_size = 16 * 1024,
 };
 
+typedef enum ecs_command_type_t
+{
+	k_command_add_entity,
+	k_command_remove_entity,
+	k_command_set_component,
+	k_command_set_deferred_component,
+} ecs_command_type_t;
+
+typedef struct ecs_command_t
+{
+	struct ecs_command_t* next;
+	ecs_command_type_t type;
+	int sort_key;
+	int sequence;
+	int buffer_index;
+
+	// Entity to remove or write to. Filled in by playback for spawns.
+	ecs_entity_ref_t ref;
+	// Spawn command whose entity a deferred write targets.
+	struct ecs_command_t* spawn;
+	ecs_mask_t component_mask;
+	int component_type;
+	void* data;
+} ecs_command_t;
+
+typedef struct ecs_command_buffer_t
+{
+	ecs_t* ecs;
+	int index;
+	arena_t* arena;
+	ecs_command_t* head;
+	ecs_command_t* tail;
+	int count;
+	int sort_key;
+} ecs_command_buffer_t;
+
 typedef enum entity_state_t
 {
 	k_entity_unused,
@@ -19,69 +71,202 @@ typedef enum entity_state_t
 	k_entity_pending_remove,
 } entity_state_t;
 
+// All entities with the same component mask.
+// Components are stored in fixed-size chunks, one tightly packed array per
+// component type. Each chunk starts with the tick at which each of its
+// component arrays was last written, followed by the index of the entity in
+// each row. Rows are numbered across chunks; row r lives in chunk
+// r / chunk_capacity.
+// Rows [0, active_count) are spawned entities. Rows [active_count, row_count)
+// are pending add, so spawning never disturbs an active query.
+typedef struct ecs_archetype_t
+{
+	ecs_mask_t component_mask;
+	int chunk_capacity;
+	size_t chunk_size;
+	size_t entities_offset;
+
+	// Component types with storage, in ascending order, and the offset of
+	// each one's array within a chunk. Tags appear only in component_mask.
+	int component_count;
+	int component_types[k_max_component_types];
+	size_t component_offsets[k_max_component_types];
+	// Position of each component type in component_types, or -1.
+	int component_indices[k_max_component_types];
+
+	int active_count;
+	int row_count;
+
+	char** chunks;
+	int chunk_count;
+	int max_chunk_count;
+} ecs_archetype_t;
+
+// Per-entity bookkeeping. Component data lives in the entity's archetype.
+typedef struct ecs_entity_t
+{
+	int sequence;
+	entity_state_t state;
+	int archetype;
+	int row;
+	// Next slot in the free list while unused.
+	int next_free;
+} ecs_entity_t;
+
+// Growable list of entity indices.
+typedef struct ecs_index_list_t
+{
+	int* items;
+	int count;
+	int capacity;
+} ecs_index_list_t;
+
 typedef struct ecs_t
 {
 	heap_t* heap;
 	int global_sequence;
 
-	int sequences[k_max_entities];
-	entity_state_t entity_states[k_max_entities];
-	uint64_t component_masks[k_max_entities];
+	ecs_entity_t** entity_pages;
+	int entity_page_count;
+	int max_entity_page_count;
+	// Number of entity slots ever used; slots past this are untouched.
+	int entity_count;
+	// Most recently freed unused slot, or -1.
+	int free_entity;
+
+	// Entities whose state changes at the next ecs_update().
+	ecs_index_list_t pending_adds;
+	ecs_index_list_t pending_removes;
 
-	void* components[k_max_component_types];
+	ecs_archetype_t* archetypes[k_max_archetypes];
+	int archetype_count;
+
+	// Command buffers, claimed by thread id.
+	int command_buffer_threads[k_max_command_buffers];
+	ecs_command_buffer_t* command_buffers[k_max_command_buffers];
+
+	// Incremented by every ecs_update().
+	uint32_t tick;
+
+	int component_type_count;
 	size_t component_type_sizes[k_max_component_types];
+	size_t component_type_alignments[k_max_component_types];
 	char component_type_names[k_max_component_types][32];
 } ecs_t;
 
+static bool add_entity_page(ecs_t* ecs);
+static bool index_list_push(ecs_t* ecs, ecs_index_list_t* list, int index);
+static void play_back_commands(ecs_t* ecs);
+static int find_or_create_archetype(ecs_t* ecs, ecs_mask_t component_mask);
+static int archetype_push_row(ecs_t* ecs, ecs_archetype_t* archetype, int entity);
+static void archetype_remove_row(ecs_t* ecs, ecs_archetype_t* archetype, int row);
+static void* archetype_get_component(ecs_t* ecs, ecs_archetype_t* archetype, int row, int component_type, bool write);
+
+static int* archetype_get_entities(ecs_archetype_t* archetype, int chunk_index)
+{
+	return (int*)(archetype->chunks[chunk_index] + archetype->entities_offset);
+}
+
+static uint32_t* archetype_get_versions(ecs_archetype_t* archetype, int chunk_index)
+{
+	return (uint32_t*)archetype->chunks[chunk_index];
+}
+
+static ecs_entity_t* get_entity(ecs_t* ecs, int entity)
+{
+	return &ecs->entity_pages[entity >> k_entity_page_shift][entity & (k_entity_page_size - 1)];
+}
+
 ecs_t* ecs_create(heap_t* heap)
 {
 	ecs_t* ecs = heap_alloc(heap, sizeof(ecs_t), 8);
 	memset(ecs, 0, sizeof(*ecs));
 	ecs->heap = heap;
 	ecs->global_sequence = 1;
+	ecs->free_entity = -1;
+	ecs->tick = 1;
 	return ecs;
 }
 
 void ecs_destroy(ecs_t* ecs)
 {
-	for (int i = 0; i < _countof(ecs->components); ++i)
+	for (int i = 0; i < ecs->archetype_count; ++i)
+	{
+		ecs_archetype_t* archetype = ecs->archetypes[i];
+		for (int c = 0; c < archetype->chunk_count; ++c)
+		{
+			heap_free(ecs->heap, archetype->chunks[c]);
+		}
+		heap_free(ecs->heap, archetype->chunks);
+		heap_free(ecs->heap, archetype);
+	}
+	for (int i = 0; i < ecs->entity_page_count; ++i)
 	{
-		if (ecs->components[i])
+		heap_free(ecs->heap, ecs->entity_pages[i]);
+	}
+	heap_free(ecs->heap, ecs->entity_pages);
+	for (int i = 0; i < _countof(ecs->command_buffers); ++i)
+	{
+		if (ecs->command_buffers[i])
 		{
-			heap_free(ecs->heap, ecs->components[i]);
+			arena_destroy(ecs->command_buffers[i]->arena);
+			heap_free(ecs->heap, ecs->command_buffers[i]);
 		}
 	}
+	heap_free(ecs->heap, ecs->pending_adds.items);
+	heap_free(ecs->heap, ecs->pending_removes.items);
 	heap_free(ecs->heap, ecs);
 }
 
 void ecs_update(ecs_t* ecs)
 {
-	for (int i = 0; i < _countof(ecs->entity_states); ++i)
+	play_back_commands(ecs);
+
+	// Removals first: an entity removed before it finished spawning must not
+	// be promoted.
+	for (int i = 0; i < ecs->pending_removes.count; ++i)
 	{
-		if (ecs->entity_states[i] == k_entity_pending_add)
-		{
-			ecs->entity_states[i] = k_entity_active;
-		}
-		else if (ecs->entity_states[i] == k_entity_pending_remove)
+		int index = ecs->pending_removes.items[i];
+		ecs_entity_t* entity = get_entity(ecs, index);
+		archetype_remove_row(ecs, ecs->archetypes[entity->archetype], entity->row);
+		entity->state = k_entity_unused;
+		entity->next_free = ecs->free_entity;
+		ecs->free_entity = index;
+	}
+	ecs->pending_removes.count = 0;
+
+	for (int i = 0; i < ecs->pending_adds.count; ++i)
+	{
+		ecs_entity_t* entity = get_entity(ecs, ecs->pending_adds.items[i]);
+		if (entity->state == k_entity_pending_add)
 		{
-			ecs->entity_states[i] = k_entity_unused;
+			entity->state = k_entity_active;
 		}
 	}
+	ecs->pending_adds.count = 0;
+
+	ecs->tick++;
+
+	for (int i = 0; i < ecs->archetype_count; ++i)
+	{
+		ecs->archetypes[i]->active_count = ecs->archetypes[i]->row_count;
+	}
 }
 
 int ecs_register_component_type(ecs_t* ecs, const char* name, size_t size_per_component, size_t alignment)
 {
-	for (int i = 0; i < _countof(ecs->components); ++i)
+	if (ecs->component_type_count < k_max_component_types)
 	{
-		if (ecs->components[i] == NULL)
+		int i = ecs->component_type_count++;
+		if (size_per_component == 0)
 		{
-			size_t aligned_size = (size_per_component + (alignment - 1)) & ~(alignment - 1);
-			strcpy_s(ecs->component_type_names[i], sizeof(ecs->component_type_names[i]), name);
-			ecs->component_type_sizes[i] = aligned_size;
-			ecs->components[i] = heap_alloc(ecs->heap, aligned_size * k_max_entities, alignment);
-			memset(ecs->components[i], 0, aligned_size * k_max_entities);
-			return i;
+			alignment = 1;
 		}
+		size_t aligned_size = (size_per_component + (alignment - 1)) & ~(alignment - 1);
+		strcpy_s(ecs->component_type_names[i], sizeof(ecs->component_type_names[i]), name);
+		ecs->component_type_sizes[i] = aligned_size;
+		ecs->component_type_alignments[i] = alignment;
+		return i;
 	}
 	debug_print(k_print_warning, "Out of component types.");
 	return -1;
@@ -92,27 +277,66 @@ size_t ecs_get_component_type_size(ecs_t* ecs, int component_type)
 	return ecs->component_type_sizes[component_type];
 }
 
-ecs_entity_ref_t ecs_entity_add(ecs_t* ecs, uint64_t component_mask)
+bool ecs_entity_has_component(ecs_t* ecs, ecs_entity_ref_t ref, int component_type, bool allow_pending_add)
 {
-	for (int i = 0; i < _countof(ecs->entity_states); ++i)
+	if (ecs_is_entity_ref_valid(ecs, ref, allow_pending_add))
 	{
-		if (ecs->entity_states[i] == k_entity_unused)
-		{
-			ecs->entity_states[i] = k_entity_pending_add;
-			ecs->sequences[i] = ecs->global_sequence++;
-			ecs->component_masks[i] = component_mask;
-			return (ecs_entity_ref_t) { .entity = i, .sequence = ecs->sequences[i] };
-		}
+		ecs_entity_t* entity = get_entity(ecs, ref.entity);
+		return ecs_mask_test(ecs->archetypes[entity->archetype]->component_mask, component_type);
+	}
+	return false;
+}
+
+ecs_entity_ref_t ecs_entity_add(ecs_t* ecs, ecs_mask_t component_mask)
+{
+	int i = ecs->free_entity >= 0 ? ecs->free_entity : ecs->entity_count;
+	if (i == ecs->entity_count && !add_entity_page(ecs))
+	{
+		debug_print(k_print_warning, "Out of entities.");
+		return (ecs_entity_ref_t) { .entity = -1, .sequence = -1 };
+	}
+
+	int archetype_index = find_or_create_archetype(ecs, component_mask);
+	if (archetype_index < 0 || !index_list_push(ecs, &ecs->pending_adds, i))
+	{
+		debug_print(k_print_warning, "Out of entities.");
+		return (ecs_entity_ref_t) { .entity = -1, .sequence = -1 };
+	}
+	int row = archetype_push_row(ecs, ecs->archetypes[archetype_index], i);
+	if (row < 0)
+	{
+		ecs->pending_adds.count--;
+		debug_print(k_print_warning, "Out of entities.");
+		return (ecs_entity_ref_t) { .entity = -1, .sequence = -1 };
+	}
+
+	ecs_entity_t* entity = get_entity(ecs, i);
+	if (i == ecs->entity_count)
+	{
+		ecs->entity_count++;
 	}
-	debug_print(k_print_warning, "Out of entities.");
-	return (ecs_entity_ref_t) { .entity = -1, .sequence = -1 };
+	else
+	{
+		ecs->free_entity = entity->next_free;
+	}
+
+	entity->state = k_entity_pending_add;
+	entity->sequence = ecs->global_sequence++;
+	entity->archetype = archetype_index;
+	entity->row = row;
+	return (ecs_entity_ref_t) { .entity = i, .sequence = entity->sequence };
 }
 
 void ecs_entity_remove(ecs_t* ecs, ecs_entity_ref_t ref, bool allow_pending_add)
 {
 	if (ecs_is_entity_ref_valid(ecs, ref, allow_pending_add))
 	{
-		ecs->entity_states[ref.entity] = k_entity_pending_remove;
+		ecs_entity_t* entity = get_entity(ecs, ref.entity);
+		if (entity->state != k_entity_pending_remove &&
+			index_list_push(ecs, &ecs->pending_removes, ref.entity))
+		{
+			entity->state = k_entity_pending_remove;
+		}
 	}
 	else
 	{
@@ -122,24 +346,43 @@ void ecs_entity_remove(ecs_t* ecs, ecs_entity_ref_t ref, bool allow_pending_add)
 
 bool ecs_is_entity_ref_valid(ecs_t* ecs, ecs_entity_ref_t ref, bool allow_pending_add)
 {
-	return ref.entity >= 0 &&
-		ecs->sequences[ref.entity] == ref.sequence &&
-		ecs->entity_states[ref.entity] >= (allow_pending_add ? k_entity_pending_add : k_entity_active);
+	if (ref.entity < 0 || ref.entity >= ecs->entity_count)
+	{
+		return false;
+	}
+	ecs_entity_t* entity = get_entity(ecs, ref.entity);
+	return entity->sequence == ref.sequence &&
+		entity->state >= (allow_pending_add ? k_entity_pending_add : k_entity_active);
 }
 
 void* ecs_entity_get_component(ecs_t* ecs, ecs_entity_ref_t ref, int component_type, bool allow_pending_add)
 {
-	if (ecs_is_entity_ref_valid(ecs, ref, allow_pending_add) && ecs->components[component_type])
+	if (ecs_is_entity_ref_valid(ecs, ref, allow_pending_add))
 	{
-		char* components = ecs->components[component_type];
-		return &components[ecs->component_type_sizes[component_type] * ref.entity];
+		ecs_entity_t* entity = get_entity(ecs, ref.entity);
+		return archetype_get_component(ecs, ecs->archetypes[entity->archetype], entity->row, component_type, true);
 	}
 	return NULL;
 }
 
-ecs_query_t ecs_query_create(ecs_t* ecs, uint64_t mask)
+const void* ecs_entity_get_component_read_only(ecs_t* ecs, ecs_entity_ref_t ref, int component_type, bool allow_pending_add)
 {
-	ecs_query_t query = { .component_mask = mask, .entity = -1 };
+	if (ecs_is_entity_ref_valid(ecs, ref, allow_pending_add))
+	{
+		ecs_entity_t* entity = get_entity(ecs, ref.entity);
+		return archetype_get_component(ecs, ecs->archetypes[entity->archetype], entity->row, component_type, false);
+	}
+	return NULL;
+}
+
+uint32_t ecs_get_tick(ecs_t* ecs)
+{
+	return ecs->tick;
+}
+
+ecs_query_t ecs_query_create(ecs_t* ecs, ecs_mask_t mask)
+{
+	ecs_query_t query = { .component_mask = mask, .archetype = 0, .row = -1, .entity = -1 };
 	ecs_query_next(ecs, &query);
 	return query;
 }
@@ -151,11 +394,17 @@ bool ecs_query_is_valid(ecs_t* ecs, ecs_query_t* query)
 
 void ecs_query_next(ecs_t* ecs, ecs_query_t* query)
 {
-	for (int i = query->entity + 1; i < _countof(ecs->component_masks); ++i)
+	// Only archetypes that contain the queried components are visited.
+	// The mask is tested once per archetype, on its first row.
+	query->row++;
+	for (; query->archetype < ecs->archetype_count; query->archetype++, query->row = 0)
 	{
-		if ((ecs->component_masks[i] & query->component_mask) == query->component_mask && ecs->entity_states[i] >= k_entity_active)
+		ecs_archetype_t* archetype = ecs->archetypes[query->archetype];
+		if (query->row < archetype->active_count &&
+			(query->row > 0 || ecs_mask_contains(archetype->component_mask, query->component_mask)))
 		{
-			query->entity = i;
+			int* entities = archetype_get_entities(archetype, query->row / archetype->chunk_capacity);
+			query->entity = entities[query->row % archetype->chunk_capacity];
 			return;
 		}
 	}
@@ -164,11 +413,575 @@ void ecs_query_next(ecs_t* ecs, ecs_query_t* query)
 
 void* ecs_query_get_component(ecs_t* ecs, ecs_query_t* query, int component_type)
 {
-	char* components = ecs->components[component_type];
-	return &components[ecs->component_type_sizes[component_type] * query->entity];
+	return archetype_get_component(ecs, ecs->archetypes[query->archetype], query->row, component_type, true);
+}
+
+const void* ecs_query_get_component_read_only(ecs_t* ecs, ecs_query_t* query, int component_type)
+{
+	return archetype_get_component(ecs, ecs->archetypes[query->archetype], query->row, component_type, false);
 }
 
 ecs_entity_ref_t ecs_query_get_entity(ecs_t* ecs, ecs_query_t* query)
 {
-	return (ecs_entity_ref_t) { .entity = query->entity, .sequence = ecs->sequences[query->entity] };
+	return (ecs_entity_ref_t) { .entity = query->entity, .sequence = get_entity(ecs, query->entity)->sequence };
+}
+
+static bool index_list_push(ecs_t* ecs, ecs_index_list_t* list, int index)
+{
+	if (list->count == list->capacity)
+	{
+		int capacity = list->capacity ? list->capacity * 2 : 64;
+		int* items = heap_alloc(ecs->heap, sizeof(int) * capacity, 8);
+		if (!items)
+		{
+			return false;
+		}
+		if (list->items)
+		{
+			memcpy(items, list->items, sizeof(int) * list->count);
+			heap_free(ecs->heap, list->items);
+		}
+		list->items = items;
+		list->capacity = capacity;
+	}
+	list->items[list->count++] = index;
+	return true;
+}
+
+ecs_chunk_query_t ecs_chunk_query_create(ecs_t* ecs, ecs_mask_t mask)
+{
+	return ecs_chunk_query_create_changed(ecs, mask, ecs_mask_none(), 0);
+}
+
+ecs_chunk_query_t ecs_chunk_query_create_changed(ecs_t* ecs, ecs_mask_t mask, ecs_mask_t changed_mask, uint32_t since_tick)
+{
+	ecs_chunk_query_t query =
+	{
+		.component_mask = mask,
+		.changed_mask = changed_mask,
+		.since_tick = since_tick,
+		.archetype = 0,
+		.chunk = -1,
+		.count = 0,
+	};
+	ecs_chunk_query_next(ecs, &query);
+	return query;
+}
+
+static bool is_chunk_changed(ecs_archetype_t* archetype, int chunk_index, ecs_mask_t changed_mask, uint32_t since_tick)
+{
+	uint32_t* versions = archetype_get_versions(archetype, chunk_index);
+	for (int i = 0; i < archetype->component_count; ++i)
+	{
+		if (ecs_mask_test(changed_mask, archetype->component_types[i]) && versions[i] >= since_tick)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+bool ecs_chunk_query_is_valid(ecs_t* ecs, ecs_chunk_query_t* query)
+{
+	return query->count > 0;
+}
+
+void ecs_chunk_query_next(ecs_t* ecs, ecs_chunk_query_t* query)
+{
+	query->chunk++;
+	for (; query->archetype < ecs->archetype_count; query->archetype++, query->chunk = 0)
+	{
+		ecs_archetype_t* archetype = ecs->archetypes[query->archetype];
+		if (!ecs_mask_contains(archetype->component_mask, query->component_mask))
+		{
+			continue;
+		}
+
+		for (; query->chunk * archetype->chunk_capacity < archetype->active_count; query->chunk++)
+		{
+			if (ecs_mask_is_empty(query->changed_mask) ||
+				is_chunk_changed(archetype, query->chunk, query->changed_mask, query->since_tick))
+			{
+				int first_row = query->chunk * archetype->chunk_capacity;
+				query->count = __min(archetype->chunk_capacity, archetype->active_count - first_row);
+				return;
+			}
+		}
+	}
+	query->count = 0;
+}
+
+void* ecs_chunk_query_get_components(ecs_t* ecs, ecs_chunk_query_t* query, int component_type)
+{
+	ecs_archetype_t* archetype = ecs->archetypes[query->archetype];
+	return archetype_get_component(ecs, archetype, query->chunk * archetype->chunk_capacity, component_type, true);
+}
+
+const void* ecs_chunk_query_get_components_read_only(ecs_t* ecs, ecs_chunk_query_t* query, int component_type)
+{
+	ecs_archetype_t* archetype = ecs->archetypes[query->archetype];
+	return archetype_get_component(ecs, archetype, query->chunk * archetype->chunk_capacity, component_type, false);
+}
+
+ecs_entity_ref_t ecs_chunk_query_get_entity(ecs_t* ecs, ecs_chunk_query_t* query, int index)
+{
+	int entity = archetype_get_entities(ecs->archetypes[query->archetype], query->chunk)[index];
+	return (ecs_entity_ref_t) { .entity = entity, .sequence = get_entity(ecs, entity)->sequence };
+}
+
+ecs_command_buffer_t* ecs_get_command_buffer(ecs_t* ecs)
+{
+	int thread_id = get_current_thread_id();
+	for (int i = 0; i < _countof(ecs->command_buffers); ++i)
+	{
+		int owner = atomic_load(&ecs->command_buffer_threads[i]);
+		if (owner == 0 && atomic_compare_and_exchange(&ecs->command_buffer_threads[i], 0, thread_id) == 0)
+		{
+			ecs_command_buffer_t* buffer = heap_alloc(ecs->heap, sizeof(ecs_command_buffer_t), 8);
+			arena_t* arena = buffer ? arena_create(ecs->heap, k_command_arena_block_size) : NULL;
+			if (!arena)
+			{
+				heap_free(ecs->heap, buffer);
+				atomic_store(&ecs->command_buffer_threads[i], 0);
+				return NULL;
+			}
+			memset(buffer, 0, sizeof(*buffer));
+			buffer->ecs = ecs;
+			buffer->index = i;
+			buffer->arena = arena;
+			ecs->command_buffers[i] = buffer;
+			return buffer;
+		}
+		if (owner == thread_id)
+		{
+			return ecs->command_buffers[i];
+		}
+	}
+	debug_print(k_print_error, "Out of command buffers.\n");
+	return NULL;
+}
+
+void ecs_command_buffer_set_sort_key(ecs_command_buffer_t* buffer, int sort_key)
+{
+	buffer->sort_key = sort_key;
+}
+
+int ecs_command_buffer_get_sort_key(ecs_command_buffer_t* buffer)
+{
+	return buffer->sort_key;
+}
+
+static ecs_command_t* push_command(ecs_command_buffer_t* buffer, ecs_command_type_t type)
+{
+	ecs_command_t* command = arena_alloc(buffer->arena, sizeof(ecs_command_t), 8);
+	if (!command)
+	{
+		return NULL;
+	}
+	memset(command, 0, sizeof(*command));
+	command->type = type;
+	command->sort_key = buffer->sort_key;
+	command->sequence = buffer->count++;
+	command->buffer_index = buffer->index;
+
+	if (buffer->tail)
+	{
+		buffer->tail->next = command;
+	}
+	else
+	{
+		buffer->head = command;
+	}
+	buffer->tail = command;
+	return command;
+}
+
+// Pushes a command carrying component data. Nothing is recorded if either
+// allocation fails, so playback never sees a command without its data.
+static ecs_command_t* push_component_command(ecs_command_buffer_t* buffer, ecs_command_type_t type, int component_type)
+{
+	ecs_t* ecs = buffer->ecs;
+	void* data = arena_alloc(buffer->arena,
+		ecs->component_type_sizes[component_type],
+		ecs->component_type_alignments[component_type]);
+	if (!data)
+	{
+		return NULL;
+	}
+	ecs_command_t* command = push_command(buffer, type);
+	if (!command)
+	{
+		return NULL;
+	}
+	command->component_type = component_type;
+	command->data = data;
+	return command;
+}
+
+ecs_deferred_entity_t ecs_command_buffer_add_entity(ecs_command_buffer_t* buffer, ecs_mask_t component_mask)
+{
+	ecs_command_t* command = push_command(buffer, k_command_add_entity);
+	if (!command)
+	{
+		return (ecs_deferred_entity_t) { .command = NULL };
+	}
+	command->component_mask = component_mask;
+	command->ref = (ecs_entity_ref_t) { .entity = -1, .sequence = -1 };
+	return (ecs_deferred_entity_t) { .command = command };
+}
+
+void ecs_command_buffer_remove_entity(ecs_command_buffer_t* buffer, ecs_entity_ref_t ref)
+{
+	ecs_command_t* command = push_command(buffer, k_command_remove_entity);
+	if (command)
+	{
+		command->ref = ref;
+	}
+}
+
+void* ecs_command_buffer_set_component(ecs_command_buffer_t* buffer, ecs_entity_ref_t ref, int component_type)
+{
+	if (buffer->ecs->component_type_sizes[component_type] == 0)
+	{
+		return NULL;
+	}
+	ecs_command_t* command = push_component_command(buffer, k_command_set_component, component_type);
+	if (!command)
+	{
+		return NULL;
+	}
+	command->ref = ref;
+	return command->data;
+}
+
+void* ecs_command_buffer_set_deferred_component(ecs_command_buffer_t* buffer, ecs_deferred_entity_t entity, int component_type)
+{
+	if (!entity.command || buffer->ecs->component_type_sizes[component_type] == 0)
+	{
+		return NULL;
+	}
+	if (entity.command->buffer_index != buffer->index)
+	{
+		debug_print(k_print_error, "Deferred entity was spawned by another command buffer.\n");
+		return NULL;
+	}
+	ecs_command_t* command = push_component_command(buffer, k_command_set_deferred_component, component_type);
+	if (!command)
+	{
+		return NULL;
+	}
+	// Play back with the spawn even if the sort key changed since, so the
+	// entity exists by the time the set reads its ref.
+	command->sort_key = entity.command->sort_key;
+	command->spawn = entity.command;
+	return command->data;
+}
+
+static int compare_commands(const void* a, const void* b)
+{
+	const ecs_command_t* left = *(const ecs_command_t**)a;
+	const ecs_command_t* right = *(const ecs_command_t**)b;
+	if (left->sort_key != right->sort_key)
+	{
+		return left->sort_key < right->sort_key ? -1 : 1;
+	}
+	if (left->buffer_index != right->buffer_index)
+	{
+		return left->buffer_index < right->buffer_index ? -1 : 1;
+	}
+	return (left->sequence > right->sequence) - (left->sequence < right->sequence);
+}
+
+// Applies every recorded command and empties the buffers.
+// Must be called while no other thread is recording.
+static void play_back_commands(ecs_t* ecs)
+{
+	int count = 0;
+	for (int i = 0; i < _countof(ecs->command_buffers); ++i)
+	{
+		if (ecs->command_buffers[i])
+		{
+			count += ecs->command_buffers[i]->count;
+		}
+	}
+	if (count == 0)
+	{
+		return;
+	}
+
+	ecs_command_t** commands = heap_alloc(ecs->heap, sizeof(ecs_command_t*) * count, 8);
+	int index = 0;
+	for (int i = 0; i < _countof(ecs->command_buffers); ++i)
+	{
+		ecs_command_buffer_t* buffer = ecs->command_buffers[i];
+		for (ecs_command_t* command = buffer ? buffer->head : NULL; command; command = command->next)
+		{
+			commands[index++] = command;
+		}
+	}
+	qsort(commands, count, sizeof(ecs_command_t*), compare_commands);
+
+	for (int i = 0; i < count; ++i)
+	{
+		ecs_command_t* command = commands[i];
+		switch (command->type)
+		{
+		case k_command_add_entity:
+			command->ref = ecs_entity_add(ecs, command->component_mask);
+			break;
+		case k_command_remove_entity:
+			if (ecs_is_entity_ref_valid(ecs, command->ref, true))
+			{
+				ecs_entity_remove(ecs, command->ref, true);
+			}
+			break;
+		case k_command_set_deferred_component:
+			command->ref = command->spawn->ref;
+			// fall through
+		case k_command_set_component:
+		{
+			void* component = ecs_entity_get_component(ecs, command->ref, command->component_type, true);
+			if (component)
+			{
+				memcpy(component, command->data, ecs->component_type_sizes[command->component_type]);
+			}
+			break;
+		}
+		}
+	}
+
+	heap_free(ecs->heap, commands);
+
+	for (int i = 0; i < _countof(ecs->command_buffers); ++i)
+	{
+		ecs_command_buffer_t* buffer = ecs->command_buffers[i];
+		if (buffer)
+		{
+			arena_reset(buffer->arena);
+			buffer->head = NULL;
+			buffer->tail = NULL;
+			buffer->count = 0;
+			buffer->sort_key = 0;
+		}
+	}
+}
+
+// Makes room for the entity at index entity_count.
+static bool add_entity_page(ecs_t* ecs)
+{
+	if (ecs->entity_count < ecs->entity_page_count * k_entity_page_size)
+	{
+		return true;
+	}
+
+	if (ecs->entity_page_count == ecs->max_entity_page_count)
+	{
+		int max_entity_page_count = ecs->max_entity_page_count ? ecs->max_entity_page_count * 2 : 1;
+		ecs_entity_t** entity_pages = heap_alloc(ecs->heap, sizeof(ecs_entity_t*) * max_entity_page_count, 8);
+		if (!entity_pages)
+		{
+			return false;
+		}
+		if (ecs->entity_pages)
+		{
+			memcpy(entity_pages, ecs->entity_pages, sizeof(ecs_entity_t*) * ecs->entity_page_count);
+			heap_free(ecs->heap, ecs->entity_pages);
+		}
+		ecs->entity_pages = entity_pages;
+		ecs->max_entity_page_count = max_entity_page_count;
+	}
+
+	ecs_entity_t* page = heap_alloc(ecs->heap, sizeof(ecs_entity_t) * k_entity_page_size, 8);
+	if (!page)
+	{
+		return false;
+	}
+	memset(page, 0, sizeof(ecs_entity_t) * k_entity_page_size);
+	ecs->entity_pages[ecs->entity_page_count++] = page;
+	return true;
+}
+
+static int find_or_create_archetype(ecs_t* ecs, ecs_mask_t component_mask)
+{
+	for (int i = 0; i < ecs->archetype_count; ++i)
+	{
+		if (ecs_mask_equal(ecs->archetypes[i]->component_mask, component_mask))
+		{
+			return i;
+		}
+	}
+
+	if (ecs->archetype_count >= k_max_archetypes)
+	{
+		debug_print(k_print_warning, "Out of archetypes.");
+		return -1;
+	}
+
+	ecs_archetype_t* archetype = heap_alloc(ecs->heap, sizeof(ecs_archetype_t), 8);
+	memset(archetype, 0, sizeof(*archetype));
+	archetype->component_mask = component_mask;
+
+	for (int i = 0; i < _countof(archetype->component_indices); ++i)
+	{
+		archetype->component_indices[i] = -1;
+	}
+
+	// Tags have no storage; they only select the archetype.
+	size_t row_size = sizeof(int);
+	for (int i = ecs_mask_next(component_mask, 0); i >= 0 && i < ecs->component_type_count; i = ecs_mask_next(component_mask, i + 1))
+	{
+		if (ecs->component_type_sizes[i] == 0)
+		{
+			continue;
+		}
+		archetype->component_indices[i] = archetype->component_count;
+		archetype->component_types[archetype->component_count++] = i;
+		row_size += ecs->component_type_sizes[i];
+	}
+	archetype->entities_offset = sizeof(uint32_t) * archetype->component_count;
+
+	// Fit as many rows as possible into a chunk, allowing for alignment
+	// padding between the arrays. Very large entities get one row per chunk.
+	archetype->chunk_capacity = (int)((k_chunk_size - archetype->entities_offset) / row_size);
+	if (archetype->chunk_capacity < 1)
+	{
+		archetype->chunk_capacity = 1;
+	}
+	for (;;)
+	{
+		size_t offset = archetype->entities_offset + sizeof(int) * archetype->chunk_capacity;
+		for (int i = 0; i < archetype->component_count; ++i)
+		{
+			int type = archetype->component_types[i];
+			size_t alignment = ecs->component_type_alignments[type];
+			offset = (offset + (alignment - 1)) & ~(alignment - 1);
+			archetype->component_offsets[i] = offset;
+			offset += ecs->component_type_sizes[type] * archetype->chunk_capacity;
+		}
+
+		archetype->chunk_size = offset;
+		if (offset <= k_chunk_size || archetype->chunk_capacity == 1)
+		{
+			break;
+		}
+		archetype->chunk_capacity--;
+	}
+
+	ecs->archetypes[ecs->archetype_count] = archetype;
+	return ecs->archetype_count++;
+}
+
+static int archetype_push_row(ecs_t* ecs, ecs_archetype_t* archetype, int entity)
+{
+	int row = archetype->row_count;
+	int chunk_index = row / archetype->chunk_capacity;
+	if (chunk_index >= archetype->chunk_count)
+	{
+		if (archetype->chunk_count == archetype->max_chunk_count)
+		{
+			int max_chunk_count = archetype->max_chunk_count ? archetype->max_chunk_count * 2 : 4;
+			char** chunks = heap_alloc(ecs->heap, sizeof(char*) * max_chunk_count, 8);
+			if (!chunks)
+			{
+				return -1;
+			}
+			if (archetype->chunks)
+			{
+				memcpy(chunks, archetype->chunks, sizeof(char*) * archetype->chunk_count);
+				heap_free(ecs->heap, archetype->chunks);
+			}
+			archetype->chunks = chunks;
+			archetype->max_chunk_count = max_chunk_count;
+		}
+
+		char* chunk = heap_alloc(ecs->heap, archetype->chunk_size, k_chunk_alignment);
+		if (!chunk)
+		{
+			return -1;
+		}
+		archetype->chunks[archetype->chunk_count++] = chunk;
+	}
+
+	archetype->row_count++;
+
+	int index = row % archetype->chunk_capacity;
+	char* chunk = archetype->chunks[chunk_index];
+	uint32_t* versions = archetype_get_versions(archetype, chunk_index);
+	archetype_get_entities(archetype, chunk_index)[index] = entity;
+	for (int i = 0; i < archetype->component_count; ++i)
+	{
+		size_t size = ecs->component_type_sizes[archetype->component_types[i]];
+		memset(chunk + archetype->component_offsets[i] + size * index, 0, size);
+		versions[i] = ecs->tick;
+	}
+
+	return row;
+}
+
+static void archetype_move_row(ecs_t* ecs, ecs_archetype_t* archetype, int from_row, int to_row)
+{
+	int from_chunk_index = from_row / archetype->chunk_capacity;
+	int to_chunk_index = to_row / archetype->chunk_capacity;
+	char* from_chunk = archetype->chunks[from_chunk_index];
+	char* to_chunk = archetype->chunks[to_chunk_index];
+	int from_index = from_row % archetype->chunk_capacity;
+	int to_index = to_row % archetype->chunk_capacity;
+
+	int entity = archetype_get_entities(archetype, from_chunk_index)[from_index];
+	archetype_get_entities(archetype, to_chunk_index)[to_index] = entity;
+	get_entity(ecs, entity)->row = to_row;
+
+	// The destination chunk now holds different data, which counts as a change.
+	uint32_t* versions = archetype_get_versions(archetype, to_chunk_index);
+	for (int i = 0; i < archetype->component_count; ++i)
+	{
+		size_t size = ecs->component_type_sizes[archetype->component_types[i]];
+		size_t offset = archetype->component_offsets[i];
+		memcpy(to_chunk + offset + size * to_index, from_chunk + offset + size * from_index, size);
+		versions[i] = ecs->tick;
+	}
+}
+
+// Removes a row while keeping both the active and pending add ranges packed.
+static void archetype_remove_row(ecs_t* ecs, ecs_archetype_t* archetype, int row)
+{
+	if (row < archetype->active_count)
+	{
+		int last_active_row = --archetype->active_count;
+		if (row != last_active_row)
+		{
+			archetype_move_row(ecs, archetype, last_active_row, row);
+		}
+		row = last_active_row;
+	}
+
+	int last_row = --archetype->row_count;
+	if (row != last_row)
+	{
+		archetype_move_row(ecs, archetype, last_row, row);
+	}
+}
+
+// Write access marks the component array of the row's chunk as changed.
+static void* archetype_get_component(ecs_t* ecs, ecs_archetype_t* archetype, int row, int component_type, bool write)
+{
+	if (component_type < 0 || component_type >= ecs->component_type_count)
+	{
+		return NULL;
+	}
+	int index = archetype->component_indices[component_type];
+	if (index < 0)
+	{
+		return NULL;
+	}
+
+	int chunk_index = row / archetype->chunk_capacity;
+	if (write)
+	{
+		archetype_get_versions(archetype, chunk_index)[index] = ecs->tick;
+	}
+
+	char* chunk = archetype->chunks[chunk_index];
+	size_t offset = archetype->component_offsets[index];
+	return chunk + offset + ecs->component_type_sizes[component_type] * (row % archetype->chunk_capacity);
 }
@@ -2,6 +2,15 @@
 
 // Entity Component System
 // Framework for game entities and their components.
+//
+// Entities with the same set of components share an archetype, whose
+// component data is packed into fixed-size chunks. Queries visit only
+// archetypes that match. Component pointers remain valid until the next
+// ecs_update(). Removing an entity moves the last entity of its archetype
+// into the freed row, so hold an ecs_entity_ref_t across frames and look the
+// component up again rather than keeping its address.
+
+#include "ecs_mask.h"
 
 #include <stdbool.h>
 #include <stdint.h>
@@ -18,13 +27,37 @@ typedef struct ecs_entity_ref_t
 	int sequence;
 } ecs_entity_ref_t;
 
+// Records structural changes for ecs_update() to apply later.
+// See ecs_get_command_buffer().
+typedef struct ecs_command_buffer_t ecs_command_buffer_t;
+
+// Entity spawned by a command buffer. Valid until the next ecs_update().
+typedef struct ecs_deferred_entity_t
+{
+	struct ecs_command_t* command;
+} ecs_deferred_entity_t;
+
 // Working data for an active entity query.
 typedef struct ecs_query_t
 {
-	uint64_t component_mask;
+	ecs_mask_t component_mask;
+	int archetype;
+	int row;
 	int entity;
 } ecs_query_t;
 
+// Working data for an active chunk query.
+// Each step covers count matching entities stored contiguously.
+typedef struct ecs_chunk_query_t
+{
+	ecs_mask_t component_mask;
+	ecs_mask_t changed_mask;
+	uint32_t since_tick;
+	int archetype;
+	int chunk;
+	int count;
+} ecs_chunk_query_t;
+
 // Create an entity component system.
 ecs_t* ecs_create(heap_t* heap);
 
@@ -35,13 +68,20 @@ void ecs_destroy(ecs_t* ecs);
 void ecs_update(ecs_t* ecs);
 
 // Register a type of component with the entity system.
+// A size of zero registers a tag: it marks entities for queries but has no
+// data, so it is never allocated or copied and its component memory is NULL.
 int ecs_register_component_type(ecs_t* ecs, const char* name, size_t size_per_component, size_t alignment);
 
 // Return the size of a type of component registered with the sytem.
+// Zero for tags.
 size_t ecs_get_component_type_size(ecs_t* ecs, int component_type);
 
+// Determines if an entity has a component type. Works for tags, whose
+// component memory is always NULL.
+bool ecs_entity_has_component(ecs_t* ecs, ecs_entity_ref_t ref, int component_type, bool allow_pending_add);
+
 // Spawn an entity with the masked components and return a reference to it.
-ecs_entity_ref_t ecs_entity_add(ecs_t* ecs, uint64_t component_mask);
+ecs_entity_ref_t ecs_entity_add(ecs_t* ecs, ecs_mask_t component_mask);
 
 // Destroy an entity.
 // If allow_pending_add is true, can destroy an entity that is not fully spawned.
@@ -54,10 +94,21 @@ bool ecs_is_entity_ref_valid(ecs_t* ecs, ecs_entity_ref_t ref, bool allow_pendin
 // Get the memory for a component on an entity.
 // NULL is returned if the entity is not valid or the component_type is not present on the entity.
 // If allow_pending_add is true, will return component data for not fully spawned entities.
+// The pointer is valid until the next ecs_update().
 void* ecs_entity_get_component(ecs_t* ecs, ecs_entity_ref_t ref, int component_type, bool allow_pending_add);
 
+// Get the memory for a component on an entity without marking it changed.
+// Otherwise the same as ecs_entity_get_component().
+const void* ecs_entity_get_component_read_only(ecs_t* ecs, ecs_entity_ref_t ref, int component_type, bool allow_pending_add);
+
+// Get the current tick, incremented by every ecs_update().
+// Components are versioned per chunk with the tick at which they were last
+// written. Any function that returns writable component memory counts as a
+// write, as do spawning and entities moving between rows.
+uint32_t ecs_get_tick(ecs_t* ecs);
+
 // Creates a new entity query by component type mask.
-ecs_query_t ecs_query_create(ecs_t* ecs, uint64_t mask);
+ecs_query_t ecs_query_create(ecs_t* ecs, ecs_mask_t mask);
 
 // Determines if the query points at a valid entity.
 bool ecs_query_is_valid(ecs_t* ecs, ecs_query_t* query);
@@ -68,5 +119,72 @@ void ecs_query_next(ecs_t* ecs, ecs_query_t* query);
 // Get data for a component on the entity referenced by the query, if any.
 void* ecs_query_get_component(ecs_t* ecs, ecs_query_t* query, int component_type);
 
+// Get data for a component on the entity referenced by the query without
+// marking it changed.
+const void* ecs_query_get_component_read_only(ecs_t* ecs, ecs_query_t* query, int component_type);
+
 // Get a entity reference for the current query location.
 ecs_entity_ref_t ecs_query_get_entity(ecs_t* ecs, ecs_query_t* query);
+
+// Creates a new query that steps through matching entities a chunk at a time.
+ecs_chunk_query_t ecs_chunk_query_create(ecs_t* ecs, ecs_mask_t mask);
+
+// Creates a chunk query that skips chunks in which none of the components in
+// changed_mask were written at or after since_tick. To see every change once,
+// pass the tick returned by ecs_get_tick() before the previous pass; runs
+// written during that pass may be reported again.
+ecs_chunk_query_t ecs_chunk_query_create_changed(ecs_t* ecs, ecs_mask_t mask, ecs_mask_t changed_mask, uint32_t since_tick);
+
+// Determines if the chunk query points at a run of matching entities.
+bool ecs_chunk_query_is_valid(ecs_t* ecs, ecs_chunk_query_t* query);
+
+// Advances the chunk query to the next run of matching entities, if any.
+void ecs_chunk_query_next(ecs_t* ecs, ecs_chunk_query_t* query);
+
+// Get the array of query->count components of a type for the current run.
+// Element i belongs to the entity returned by ecs_chunk_query_get_entity(..., i).
+void* ecs_chunk_query_get_components(ecs_t* ecs, ecs_chunk_query_t* query, int component_type);
+
+// Get the array of components of a type for the current run without marking
+// it changed.
+const void* ecs_chunk_query_get_components_read_only(ecs_t* ecs, ecs_chunk_query_t* query, int component_type);
+
+// Get a entity reference for an entity in the current run.
+ecs_entity_ref_t ecs_chunk_query_get_entity(ecs_t* ecs, ecs_chunk_query_t* query, int index);
+
+// Get the calling thread's command buffer.
+// Each thread records into its own buffer without locking, so systems
+// running in parallel can spawn and remove entities. All buffers are played
+// back at the start of the next ecs_update(), ordered by sort key and then
+// by the order commands were recorded. The result does not depend on which
+// thread recorded a command as long as no two threads use the same sort key.
+// Returns NULL if every buffer is taken or the heap is out of memory.
+ecs_command_buffer_t* ecs_get_command_buffer(ecs_t* ecs);
+
+// Set the sort key for commands recorded after this call.
+// Keys reset to zero after every playback. ecs_scheduler_t sets a unique,
+// deterministic key for each chunk it hands to a system.
+void ecs_command_buffer_set_sort_key(ecs_command_buffer_t* buffer, int sort_key);
+
+// Get the sort key set by ecs_command_buffer_set_sort_key().
+int ecs_command_buffer_get_sort_key(ecs_command_buffer_t* buffer);
+
+// Record spawning an entity with the masked components.
+// Records nothing if the buffer is out of memory; setting components on the
+// result then returns NULL.
+ecs_deferred_entity_t ecs_command_buffer_add_entity(ecs_command_buffer_t* buffer, ecs_mask_t component_mask);
+
+// Record destroying an entity. Ignored if the entity is gone by playback.
+void ecs_command_buffer_remove_entity(ecs_command_buffer_t* buffer, ecs_entity_ref_t ref);
+
+// Record writing a component of an entity.
+// Returns memory of the component's size to fill in, copied to the entity on
+// playback. Ignored if the entity or component is gone by playback.
+// Returns NULL, recording nothing, for tags or if out of memory.
+void* ecs_command_buffer_set_component(ecs_command_buffer_t* buffer, ecs_entity_ref_t ref, int component_type);
+
+// Record writing a component of an entity spawned by the same buffer.
+// Plays back right after the spawn, under the spawn's sort key.
+// Returns memory of the component's size to fill in, or NULL for tags or if
+// out of memory.
+void* ecs_command_buffer_set_deferred_component(ecs_command_buffer_t* buffer, ecs_deferred_entity_t entity, int component_type);
@@ -0,0 +1,144 @@
+#include "ecs_bench.h"
+
+#include "debug.h"
+#include "ecs.h"
+#include "heap.h"
+#include "timer.h"
+#include "transform.h"
+
+enum
+{
+	k_bench_query_passes = 10,
+	// One chunk in this many is written before the changed query phase.
+	k_bench_changed_chunk_stride = 16,
+};
+
+typedef struct bench_transform_component_t
+{
+	transform_t transform;
+} bench_transform_component_t;
+
+typedef struct bench_velocity_component_t
+{
+	vec3f_t velocity;
+} bench_velocity_component_t;
+
+static void report_phase(const char* name, int entity_count, uint64_t duration_us)
+{
+	double entities_per_second = duration_us ? entity_count * 1000000.0 / duration_us : 0.0;
+	debug_print(k_print_info, "ecs_bench %s entities=%d duration=%lluus entities/sec=%.0f\n",
+		name, entity_count, duration_us, entities_per_second);
+}
+
+void ecs_bench_spawn_and_query(int entity_count)
+{
+	heap_t* heap = heap_create(2 * 1024 * 1024);
+	ecs_t* ecs = ecs_create(heap);
+
+	int transform_type = ecs_register_component_type(ecs, "transform", sizeof(bench_transform_component_t), _Alignof(bench_transform_component_t));
+	int velocity_type = ecs_register_component_type(ecs, "velocity", sizeof(bench_velocity_component_t), _Alignof(bench_velocity_component_t));
+	ecs_mask_t mask = ecs_mask_of(transform_type);
+	ecs_mask_set(&mask, velocity_type);
+
+	uint64_t t0 = timer_get_ticks();
+	for (int i = 0; i < entity_count; ++i)
+	{
+		ecs_entity_ref_t ref = ecs_entity_add(ecs, mask);
+
+		bench_transform_component_t* transform_comp = ecs_entity_get_component(ecs, ref, transform_type, true);
+		transform_identity(&transform_comp->transform);
+
+		bench_velocity_component_t* velocity_comp = ecs_entity_get_component(ecs, ref, velocity_type, true);
+		velocity_comp->velocity = (vec3f_t){ .x = (float)(i % 7), .y = 1.0f, .z = -1.0f };
+	}
+	report_phase("spawn", entity_count, timer_ticks_to_us(timer_get_ticks() - t0));
+
+	t0 = timer_get_ticks();
+	ecs_update(ecs);
+	report_phase("update", entity_count, timer_ticks_to_us(timer_get_ticks() - t0));
+
+	t0 = timer_get_ticks();
+	for (int pass = 0; pass < k_bench_query_passes; ++pass)
+	{
+		for (ecs_query_t query = ecs_query_create(ecs, mask);
+			ecs_query_is_valid(ecs, &query);
+			ecs_query_next(ecs, &query))
+		{
+			bench_transform_component_t* transform_comp = ecs_query_get_component(ecs, &query, transform_type);
+			bench_velocity_component_t* velocity_comp = ecs_query_get_component(ecs, &query, velocity_type);
+			transform_comp->transform.translation = vec3f_add(
+				transform_comp->transform.translation,
+				vec3f_scale(velocity_comp->velocity, 0.016f));
+		}
+	}
+	report_phase("query", entity_count * k_bench_query_passes, timer_ticks_to_us(timer_get_ticks() - t0));
+
+	t0 = timer_get_ticks();
+	for (int pass = 0; pass < k_bench_query_passes; ++pass)
+	{
+		for (ecs_chunk_query_t query = ecs_chunk_query_create(ecs, mask);
+			ecs_chunk_query_is_valid(ecs, &query);
+			ecs_chunk_query_next(ecs, &query))
+		{
+			bench_transform_component_t* transform_comps = ecs_chunk_query_get_components(ecs, &query, transform_type);
+			bench_velocity_component_t* velocity_comps = ecs_chunk_query_get_components(ecs, &query, velocity_type);
+			for (int i = 0; i < query.count; ++i)
+			{
+				transform_comps[i].transform.translation = vec3f_add(
+					transform_comps[i].transform.translation,
+					vec3f_scale(velocity_comps[i].velocity, 0.016f));
+			}
+		}
+	}
+	report_phase("chunk_query", entity_count * k_bench_query_passes, timer_ticks_to_us(timer_get_ticks() - t0));
+
+	// Write velocities in a few chunks, then integrate only the chunks whose
+	// velocity changed. Every other chunk should be skipped.
+	ecs_update(ecs);
+	uint32_t since_tick = ecs_get_tick(ecs);
+	int written_chunks = 0;
+	int chunk_index = 0;
+	for (ecs_chunk_query_t query = ecs_chunk_query_create(ecs, mask);
+		ecs_chunk_query_is_valid(ecs, &query);
+		ecs_chunk_query_next(ecs, &query))
+	{
+		if (chunk_index++ % k_bench_changed_chunk_stride == 0)
+		{
+			bench_velocity_component_t* velocity_comps = ecs_chunk_query_get_components(ecs, &query, velocity_type);
+			velocity_comps[0].velocity.y = 2.0f;
+			written_chunks++;
+		}
+	}
+
+	ecs_mask_t changed_mask = ecs_mask_of(velocity_type);
+	int visited_chunks = 0;
+	int visited_entities = 0;
+	t0 = timer_get_ticks();
+	for (int pass = 0; pass < k_bench_query_passes; ++pass)
+	{
+		for (ecs_chunk_query_t query = ecs_chunk_query_create_changed(ecs, mask, changed_mask, since_tick);
+			ecs_chunk_query_is_valid(ecs, &query);
+			ecs_chunk_query_next(ecs, &query))
+		{
+			bench_transform_component_t* transform_comps = ecs_chunk_query_get_components(ecs, &query, transform_type);
+			const bench_velocity_component_t* velocity_comps = ecs_chunk_query_get_components_read_only(ecs, &query, velocity_type);
+			for (int i = 0; i < query.count; ++i)
+			{
+				transform_comps[i].transform.translation = vec3f_add(
+					transform_comps[i].transform.translation,
+					vec3f_scale(velocity_comps[i].velocity, 0.016f));
+			}
+			visited_chunks++;
+			visited_entities += query.count;
+		}
+	}
+	report_phase("changed_chunk_query", visited_entities, timer_ticks_to_us(timer_get_ticks() - t0));
+	if (visited_chunks != written_chunks * k_bench_query_passes)
+	{
+		debug_print(k_print_error, "ecs_bench changed_chunk_query visited %d chunks, expected %d of %d\n",
+			visited_chunks / k_bench_query_passes, written_chunks, chunk_index);
+	}
+
+	ecs_destroy(ecs);
+	heap_destroy(heap);
+}
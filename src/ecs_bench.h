@@ -0,0 +1,11 @@
+#pragma once
+
+// Entity component system benchmarks.
+// Results are reported with debug_print.
+
+// Spawns entity_count entities with a transform and a velocity, promotes
+// them with ecs_update(), then integrates every transform, first with the
+// per-entity query and then with the chunk query. Then writes the velocity
+// in a few chunks and integrates again with a changed chunk query, which
+// should visit only those chunks. Reports the time spent in each phase.
+void ecs_bench_spawn_and_query(int entity_count);
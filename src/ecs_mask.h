@@ -0,0 +1,161 @@
+#pragma once
+
+// Component Mask
+// Fixed-size bitset with one bit per ECS component type.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <intrin.h>
+#include <emmintrin.h>
+
+enum
+{
+	// Maximum number of component types an ecs_t can register.
+	k_ecs_mask_bit_count = 256,
+	k_ecs_mask_word_count = k_ecs_mask_bit_count / 64,
+};
+
+// Only 8 byte aligned so it can be embedded anywhere; SIMD paths use
+// unaligned loads.
+typedef struct ecs_mask_t
+{
+	uint64_t words[k_ecs_mask_word_count];
+} ecs_mask_t;
+
+__forceinline __m128i ecs_mask_load_lo(const ecs_mask_t* mask)
+{
+	return _mm_loadu_si128((const __m128i*)&mask->words[0]);
+}
+
+__forceinline __m128i ecs_mask_load_hi(const ecs_mask_t* mask)
+{
+	return _mm_loadu_si128((const __m128i*)&mask->words[2]);
+}
+
+__forceinline bool ecs_mask_is_zero_128(__m128i bits)
+{
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(bits, _mm_setzero_si128())) == 0xffff;
+}
+
+// Mask with no component types.
+__forceinline ecs_mask_t ecs_mask_none()
+{
+	return (ecs_mask_t) { .words = { 0 } };
+}
+
+// Mask with a single component type.
+// Out of range types, such as a failed registration, are ignored.
+__forceinline ecs_mask_t ecs_mask_of(int component_type)
+{
+	ecs_mask_t result = ecs_mask_none();
+	if ((unsigned)component_type < k_ecs_mask_bit_count)
+	{
+		result.words[component_type >> 6] = 1ULL << (component_type & 63);
+	}
+	return result;
+}
+
+// Add a component type to a mask.
+// Out of range types, such as a failed registration, are ignored.
+__forceinline void ecs_mask_set(ecs_mask_t* mask, int component_type)
+{
+	if ((unsigned)component_type < k_ecs_mask_bit_count)
+	{
+		mask->words[component_type >> 6] |= 1ULL << (component_type & 63);
+	}
+}
+
+// Determines if a mask has a component type.
+// Out of range types, such as a failed registration, are never in a mask.
+__forceinline bool ecs_mask_test(ecs_mask_t mask, int component_type)
+{
+	if ((unsigned)component_type >= k_ecs_mask_bit_count)
+	{
+		return false;
+	}
+	return (mask.words[component_type >> 6] >> (component_type & 63)) & 1;
+}
+
+__forceinline ecs_mask_t ecs_mask_or(ecs_mask_t a, ecs_mask_t b)
+{
+	ecs_mask_t result;
+	_mm_storeu_si128((__m128i*)&result.words[0], _mm_or_si128(ecs_mask_load_lo(&a), ecs_mask_load_lo(&b)));
+	_mm_storeu_si128((__m128i*)&result.words[2], _mm_or_si128(ecs_mask_load_hi(&a), ecs_mask_load_hi(&b)));
+	return result;
+}
+
+__forceinline ecs_mask_t ecs_mask_and(ecs_mask_t a, ecs_mask_t b)
+{
+	ecs_mask_t result;
+	_mm_storeu_si128((__m128i*)&result.words[0], _mm_and_si128(ecs_mask_load_lo(&a), ecs_mask_load_lo(&b)));
+	_mm_storeu_si128((__m128i*)&result.words[2], _mm_and_si128(ecs_mask_load_hi(&a), ecs_mask_load_hi(&b)));
+	return result;
+}
+
+__forceinline bool ecs_mask_is_empty(ecs_mask_t mask)
+{
+	return ecs_mask_is_zero_128(_mm_or_si128(ecs_mask_load_lo(&mask), ecs_mask_load_hi(&mask)));
+}
+
+__forceinline bool ecs_mask_equal(ecs_mask_t a, ecs_mask_t b)
+{
+	return ecs_mask_is_zero_128(_mm_or_si128(
+		_mm_xor_si128(ecs_mask_load_lo(&a), ecs_mask_load_lo(&b)),
+		_mm_xor_si128(ecs_mask_load_hi(&a), ecs_mask_load_hi(&b))));
+}
+
+// Determines if a and b have any component type in common.
+__forceinline bool ecs_mask_intersects(ecs_mask_t a, ecs_mask_t b)
+{
+	return !ecs_mask_is_zero_128(_mm_or_si128(
+		_mm_and_si128(ecs_mask_load_lo(&a), ecs_mask_load_lo(&b)),
+		_mm_and_si128(ecs_mask_load_hi(&a), ecs_mask_load_hi(&b))));
+}
+
+// Determines if mask has every component type in subset.
+// This is the query matching test, so it avoids branches on every word.
+__forceinline bool ecs_mask_contains(ecs_mask_t mask, ecs_mask_t subset)
+{
+#if defined(__AVX2__)
+	__m256i m = _mm256_loadu_si256((const __m256i*)mask.words);
+	__m256i s = _mm256_loadu_si256((const __m256i*)subset.words);
+	return _mm256_testc_si256(m, s) != 0;
+#else
+	return ecs_mask_is_zero_128(_mm_or_si128(
+		_mm_andnot_si128(ecs_mask_load_lo(&mask), ecs_mask_load_lo(&subset)),
+		_mm_andnot_si128(ecs_mask_load_hi(&mask), ecs_mask_load_hi(&subset))));
+#endif
+}
+
+// Return the lowest component type in mask that is at least start, or -1.
+// Visit every type in a mask with:
+//   for (int t = ecs_mask_next(mask, 0); t >= 0; t = ecs_mask_next(mask, t + 1))
+__forceinline int ecs_mask_next(ecs_mask_t mask, int start)
+{
+	for (int w = start >> 6; w < k_ecs_mask_word_count; ++w)
+	{
+		uint64_t bits = mask.words[w];
+		if (w == start >> 6)
+		{
+			bits &= ~0ULL << (start & 63);
+		}
+		unsigned long index;
+#if defined(_WIN64)
+		if (_BitScanForward64(&index, bits))
+		{
+			return (w << 6) + (int)index;
+		}
+#else
+		if (_BitScanForward(&index, (unsigned long)bits))
+		{
+			return (w << 6) + (int)index;
+		}
+		if (_BitScanForward(&index, (unsigned long)(bits >> 32)))
+		{
+			return (w << 6) + 32 + (int)index;
+		}
+#endif
+	}
+	return -1;
+}
@@ -0,0 +1,200 @@
+#include "ecs_scheduler.h"
+
+#include "debug.h"
+#include "heap.h"
+#include "job.h"
+
+#include <string.h>
+
+enum
+{
+	k_max_systems = 64,
+};
+
+typedef struct scheduler_system_t
+{
+	ecs_system_info_t info;
+	// Systems in the same stage have no conflicting accesses.
+	int stage;
+} scheduler_system_t;
+
+// One chunk of entities for one system.
+typedef struct scheduler_work_t
+{
+	struct ecs_scheduler_t* scheduler;
+	scheduler_system_t* system;
+	ecs_chunk_query_t query;
+	// Command buffer sort key for the chunk.
+	int sort_key;
+} scheduler_work_t;
+
+typedef struct ecs_scheduler_t
+{
+	heap_t* heap;
+	ecs_t* ecs;
+
+	scheduler_system_t systems[k_max_systems];
+	int system_count;
+	int stage_count;
+
+	job_system_t* jobs;
+
+	// Work for the current stage, one job per item.
+	scheduler_work_t* work;
+	int work_count;
+	int work_capacity;
+	// Command buffer sort key of the first work item in the current stage.
+	int sort_key_base;
+} ecs_scheduler_t;
+
+static void run_work(void* user);
+static bool push_work(ecs_scheduler_t* scheduler, scheduler_system_t* system, ecs_chunk_query_t* query, int sort_key);
+
+ecs_scheduler_t* ecs_scheduler_create(heap_t* heap, ecs_t* ecs, job_system_t* jobs)
+{
+	ecs_scheduler_t* scheduler = heap_alloc(heap, sizeof(ecs_scheduler_t), 8);
+	memset(scheduler, 0, sizeof(*scheduler));
+	scheduler->heap = heap;
+	scheduler->ecs = ecs;
+	scheduler->jobs = jobs;
+	return scheduler;
+}
+
+void ecs_scheduler_destroy(ecs_scheduler_t* scheduler)
+{
+	heap_free(scheduler->heap, scheduler->work);
+	heap_free(scheduler->heap, scheduler);
+}
+
+bool ecs_scheduler_add_system(ecs_scheduler_t* scheduler, const ecs_system_info_t* info)
+{
+	if (scheduler->system_count >= k_max_systems)
+	{
+		debug_print(k_print_warning, "Out of scheduler systems.");
+		return false;
+	}
+
+	// Place the system in the first stage after every earlier system it conflicts with.
+	int stage = 0;
+	for (int i = 0; i < scheduler->system_count; ++i)
+	{
+		ecs_system_info_t* other = &scheduler->systems[i].info;
+		if (ecs_mask_intersects(info->write_mask, ecs_mask_or(other->read_mask, other->write_mask)) ||
+			ecs_mask_intersects(other->write_mask, info->read_mask))
+		{
+			stage = __max(stage, scheduler->systems[i].stage + 1);
+		}
+	}
+
+	scheduler_system_t* system = &scheduler->systems[scheduler->system_count++];
+	system->info = *info;
+	system->stage = stage;
+	scheduler->stage_count = __max(scheduler->stage_count, stage + 1);
+	return true;
+}
+
+void ecs_scheduler_run(ecs_scheduler_t* scheduler)
+{
+	// Systems may run on this thread, which changes its sort key.
+	// A thread without a command buffer cannot record commands, so there is
+	// no key to keep.
+	ecs_command_buffer_t* buffer = ecs_get_command_buffer(scheduler->ecs);
+	int caller_sort_key = buffer ? ecs_command_buffer_get_sort_key(buffer) : 0;
+
+	// Key zero is left for commands recorded outside of systems.
+	scheduler->sort_key_base = 1;
+	for (int stage = 0; stage < scheduler->stage_count; ++stage)
+	{
+		scheduler->work_count = 0;
+		// Every chunk gets the next key, whether it becomes a job or not.
+		int chunk_count = 0;
+		for (int i = 0; i < scheduler->system_count; ++i)
+		{
+			scheduler_system_t* system = &scheduler->systems[i];
+			if (system->stage != stage)
+			{
+				continue;
+			}
+
+			for (ecs_chunk_query_t query = ecs_chunk_query_create(scheduler->ecs, system->info.query_mask);
+				ecs_chunk_query_is_valid(scheduler->ecs, &query);
+				ecs_chunk_query_next(scheduler->ecs, &query))
+			{
+				int sort_key = scheduler->sort_key_base + chunk_count++;
+				if (!push_work(scheduler, system, &query, sort_key))
+				{
+					// Out of memory; run this chunk here rather than drop it.
+					if (buffer)
+					{
+						ecs_command_buffer_set_sort_key(buffer, sort_key);
+					}
+					system->info.function(scheduler->ecs, &query, system->info.user);
+				}
+			}
+		}
+
+		// A single chunk is not worth a job.
+		if (scheduler->work_count == 1)
+		{
+			run_work(&scheduler->work[0]);
+		}
+		else if (scheduler->work_count > 1)
+		{
+			job_counter_t counter = { 0 };
+			for (int i = 0; i < scheduler->work_count; ++i)
+			{
+				job_run(scheduler->jobs, run_work, &scheduler->work[i], &counter);
+			}
+			job_wait(scheduler->jobs, &counter);
+		}
+
+		scheduler->sort_key_base += chunk_count;
+	}
+	if (buffer)
+	{
+		ecs_command_buffer_set_sort_key(buffer, caller_sort_key);
+	}
+}
+
+static void run_work(void* user)
+{
+	scheduler_work_t* work = user;
+	ecs_t* ecs = work->scheduler->ecs;
+
+	// Commands sort by work item, so playback order does not depend on
+	// which thread ran which chunk.
+	ecs_command_buffer_t* buffer = ecs_get_command_buffer(ecs);
+	if (buffer)
+	{
+		ecs_command_buffer_set_sort_key(buffer, work->sort_key);
+	}
+	work->system->info.function(ecs, &work->query, work->system->info.user);
+}
+
+static bool push_work(ecs_scheduler_t* scheduler, scheduler_system_t* system, ecs_chunk_query_t* query, int sort_key)
+{
+	if (scheduler->work_count == scheduler->work_capacity)
+	{
+		int work_capacity = scheduler->work_capacity ? scheduler->work_capacity * 2 : 64;
+		scheduler_work_t* work = heap_alloc(scheduler->heap, sizeof(scheduler_work_t) * work_capacity, 8);
+		if (!work)
+		{
+			return false;
+		}
+		if (scheduler->work)
+		{
+			memcpy(work, scheduler->work, sizeof(scheduler_work_t) * scheduler->work_count);
+			heap_free(scheduler->heap, scheduler->work);
+		}
+		scheduler->work = work;
+		scheduler->work_capacity = work_capacity;
+	}
+
+	scheduler_work_t* work = &scheduler->work[scheduler->work_count];
+	work->scheduler = scheduler;
+	work->system = system;
+	work->query = *query;
+	work->sort_key = sort_key;
+	scheduler->work_count++;
+	return true;
+}
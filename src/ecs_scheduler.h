@@ -0,0 +1,51 @@
+#pragma once
+
+// Entity Component System Scheduler
+//
+// Runs systems over matching entities as jobs on a job_system_t.
+// Each system declares the components it reads and writes. Systems whose
+// accesses do not conflict run concurrently; conflicting systems run in
+// the order they were added. Each matching chunk of a system is a job.
+//
+// Systems must not add or remove entities directly or touch components
+// outside their declared masks while running. Structural changes are
+// recorded with ecs_get_command_buffer() instead and applied, in a
+// deterministic order, at the next ecs_update().
+
+#include "ecs.h"
+
+typedef struct heap_t heap_t;
+typedef struct job_system_t job_system_t;
+
+// Handle to a system scheduler.
+typedef struct ecs_scheduler_t ecs_scheduler_t;
+
+// Called for each run of entities matching a system's query, possibly on
+// several threads at once.
+typedef void (*ecs_system_function_t)(ecs_t* ecs, ecs_chunk_query_t* query, void* user);
+
+// Description of a system for ecs_scheduler_add_system().
+typedef struct ecs_system_info_t
+{
+	// Components an entity must have to be processed.
+	ecs_mask_t query_mask;
+	// Components the system reads and writes.
+	ecs_mask_t read_mask;
+	ecs_mask_t write_mask;
+	ecs_system_function_t function;
+	void* user;
+} ecs_system_info_t;
+
+// Create a scheduler that runs systems on a job system.
+ecs_scheduler_t* ecs_scheduler_create(heap_t* heap, ecs_t* ecs, job_system_t* jobs);
+
+// Destroy a scheduler.
+void ecs_scheduler_destroy(ecs_scheduler_t* scheduler);
+
+// Add a system to run on every ecs_scheduler_run().
+// Returns false if there is no room for more systems.
+bool ecs_scheduler_add_system(ecs_scheduler_t* scheduler, const ecs_system_info_t* info);
+
+// Run every system once over the currently active entities.
+// The calling thread runs jobs while it waits; returns when all systems are done.
+void ecs_scheduler_run(ecs_scheduler_t* scheduler);
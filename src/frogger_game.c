@@ -2,11 +2,14 @@
 
 #include "debug.h"
 #include "ecs.h"
+#include "ecs_scheduler.h"
 #include "fs.h"
 #include "gpu.h"
 #include "heap.h"
+#include "job.h"
 #include "net.h"
 #include "render.h"
+#include "spatial_index.h"
 #include "timer_object.h"
 #include "transform.h"
 #include "wm.h"
@@ -33,6 +36,9 @@
 
 #define SPAWN_FREQ 1.0f
 
+// Grid cell size for car collision lookups, about one car wide.
+#define CAR_INDEX_CELL_SIZE 4.0f
+
 typedef struct transform_component_t
 {
 	transform_t transform;
@@ -95,6 +101,14 @@ typedef struct frogger_game_t
 	ecs_entity_ref_t car_ents[NUM_CAR_ENTITIES];
 
 	float time_until_spawn;
+	job_system_t* jobs;
+	ecs_scheduler_t* scheduler;
+	// Frame time for systems run by the scheduler.
+	float dt;
+	// Bounds of enabled cars, rebuilt on frames after a car was written.
+	spatial_index_t* car_index;
+	// ecs_get_tick() when car_index was last rebuilt.
+	uint32_t car_index_tick;
 
 	gpu_mesh_info_t player_mesh;
 	gpu_mesh_info_t car_small_mesh;
@@ -113,8 +127,10 @@ static void disable_car(frogger_game_t* game, ecs_entity_ref_t car_ent);
 static void spawn_player(frogger_game_t* game, int index);
 static void spawn_cars(frogger_game_t* game);
 static void spawn_camera(frogger_game_t* game);
+static void build_car_index(frogger_game_t* game);
 static void update_players(frogger_game_t* game);
 static void update_cars(frogger_game_t* game);
+static void move_cars(ecs_t* ecs, ecs_chunk_query_t* query, void* user);
 static void draw_models(frogger_game_t* game);
 
 frogger_game_t* frogger_game_create(heap_t* heap, fs_t* fs, wm_window_t* window, render_t* render, int argc, const char** argv)
@@ -137,6 +153,23 @@ frogger_game_t* frogger_game_create(heap_t* heap, fs_t* fs, wm_window_t* window,
 	game->car_type = ecs_register_component_type(game->ecs, "car", sizeof(car_component_t), _Alignof(car_component_t));
 	game->name_type = ecs_register_component_type(game->ecs, "name", sizeof(name_component_t), _Alignof(name_component_t));
 
+	game->jobs = job_system_create(heap, 3);
+	game->scheduler = ecs_scheduler_create(heap, game->ecs, game->jobs);
+	ecs_mask_t k_car_system_mask = ecs_mask_of(game->transform_type);
+	ecs_mask_set(&k_car_system_mask, game->car_type);
+	ecs_system_info_t car_system =
+	{
+		.query_mask = k_car_system_mask,
+		.read_mask = k_car_system_mask,
+		.write_mask = k_car_system_mask,
+		.function = move_cars,
+		.user = game,
+	};
+	ecs_scheduler_add_system(game->scheduler, &car_system);
+
+	game->car_index = spatial_index_create(heap, CAR_INDEX_CELL_SIZE);
+	game->car_index_tick = 0;
+
 	game->net = net_create(heap, game->ecs);
 	if (argc >= 2)
 	{
@@ -163,6 +196,9 @@ void frogger_game_destroy(frogger_game_t* game)
 {
 	//ma_engine_uninit(&game->audio_engine);
 	net_destroy(game->net);
+	spatial_index_destroy(game->car_index);
+	ecs_scheduler_destroy(game->scheduler);
+	job_system_destroy(game->jobs);
 	ecs_destroy(game->ecs);
 	timer_object_destroy(game->timer);
 	unload_resources(game);
@@ -174,6 +210,7 @@ void frogger_game_update(frogger_game_t* game)
 	timer_object_update(game->timer);
 	ecs_update(game->ecs);
 	net_update(game->net);
+	build_car_index(game);
 	update_players(game);
 	update_cars(game);
 	draw_models(game);
@@ -362,11 +399,10 @@ static void disable_car(frogger_game_t* game, ecs_entity_ref_t car_ent)
 
 static void spawn_player(frogger_game_t* game, int index)
 {
-	uint64_t k_player_ent_mask =
-		(1ULL << game->transform_type) |
-		(1ULL << game->model_type) |
-		(1ULL << game->player_type) |
-		(1ULL << game->name_type);
+	ecs_mask_t k_player_ent_mask = ecs_mask_of(game->transform_type);
+	ecs_mask_set(&k_player_ent_mask, game->model_type);
+	ecs_mask_set(&k_player_ent_mask, game->player_type);
+	ecs_mask_set(&k_player_ent_mask, game->name_type);
 	game->player_ent = ecs_entity_add(game->ecs, k_player_ent_mask);
 
 	name_component_t* name_comp = ecs_entity_get_component(game->ecs, game->player_ent, game->name_type, true);
@@ -382,12 +418,10 @@ static void spawn_player(frogger_game_t* game, int index)
 	model_comp->mesh_info = &game->player_mesh;
 	model_comp->shader_info = &game->cube_shader;
 
-	uint64_t k_player_ent_net_mask =
-		(1ULL << game->transform_type) |
-		(1ULL << game->model_type) |
-		(1ULL << game->name_type);
-	uint64_t k_player_ent_rep_mask =
-		(1ULL << game->transform_type);
+	ecs_mask_t k_player_ent_net_mask = ecs_mask_of(game->transform_type);
+	ecs_mask_set(&k_player_ent_net_mask, game->model_type);
+	ecs_mask_set(&k_player_ent_net_mask, game->name_type);
+	ecs_mask_t k_player_ent_rep_mask = ecs_mask_of(game->transform_type);
 	net_state_register_entity_type(game->net, 0, k_player_ent_net_mask, k_player_ent_rep_mask, player_net_configure, game);
 
 	net_state_register_entity_instance(game->net, 0, game->player_ent);
@@ -399,10 +433,9 @@ static void spawn_cars(frogger_game_t* game)
 {
 	game->time_until_spawn = SPAWN_FREQ;
 
-	uint64_t k_car_ent_mask =
-		(1ULL << game->transform_type) |
-		(1ULL << game->model_type) |
-		(1ULL << game->car_type);
+	ecs_mask_t k_car_ent_mask = ecs_mask_of(game->transform_type);
+	ecs_mask_set(&k_car_ent_mask, game->model_type);
+	ecs_mask_set(&k_car_ent_mask, game->car_type);
 
 	for (int i = 0; i < NUM_CAR_ENTITIES; ++i)
 	{
@@ -444,9 +477,8 @@ static void spawn_cars(frogger_game_t* game)
 
 static void spawn_camera(frogger_game_t* game)
 {
-	uint64_t k_camera_ent_mask =
-		(1ULL << game->camera_type) |
-		(1ULL << game->name_type);
+	ecs_mask_t k_camera_ent_mask = ecs_mask_of(game->camera_type);
+	ecs_mask_set(&k_camera_ent_mask, game->name_type);
 	game->camera_ent = ecs_entity_add(game->ecs, k_camera_ent_mask);
 
 	name_component_t* name_comp = ecs_entity_get_component(game->ecs, game->camera_ent, game->name_type, true);
@@ -467,7 +499,8 @@ static void update_players(frogger_game_t* game)
 	float dt = (float)timer_object_get_delta_ms(game->timer) * 0.001f;
 
 	uint32_t key_mask = wm_get_key_mask(game->window);
-	uint64_t k_query_mask = (1ULL << game->transform_type) | (1ULL << game->player_type);
+	ecs_mask_t k_query_mask = ecs_mask_of(game->transform_type);
+	ecs_mask_set(&k_query_mask, game->player_type);
 
 	for (ecs_query_t query = ecs_query_create(game->ecs, k_query_mask);
 		ecs_query_is_valid(game->ecs, &query);
@@ -507,37 +540,58 @@ static void update_players(frogger_game_t* game)
 		}
 
 		// detect player collision with cars
-		uint64_t k_car_query_mask = (1ULL << game->transform_type) | (1ULL << game->car_type);
-		for (ecs_query_t query = ecs_query_create(game->ecs, k_car_query_mask);
-			ecs_query_is_valid(game->ecs, &query);
-			ecs_query_next(game->ecs, &query))
+		float player_half_width = player_comp->width / 2.0f;
+		float player_half_height = player_comp->height / 2.0f;
+		vec3f_t player_min = transform_comp->transform.translation;
+		player_min.y -= player_half_width;
+		player_min.z -= player_half_height;
+		vec3f_t player_max = transform_comp->transform.translation;
+		player_max.y += player_half_width;
+		player_max.z += player_half_height;
+
+		ecs_entity_ref_t hit;
+		if (spatial_index_query_overlap(game->car_index, player_min, player_max, &hit, 1) > 0)
 		{
-			car_component_t* car_comp = ecs_query_get_component(game->ecs, &query, game->car_type);
-
-			if (!car_comp->is_enabled)
-			{
-				continue;
-			}
-
-			transform_component_t* car_transform_comp = ecs_query_get_component(game->ecs, &query, game->transform_type);
+			reset_player_position(game);
+		}
+	}
+}
 
-			float player_top_bound = transform_comp->transform.translation.z - player_comp->height / 2.0f;
-			float player_bottom_bound = transform_comp->transform.translation.z + player_comp->height / 2.0f;
-			float player_left_bound = transform_comp->transform.translation.y - player_comp->width / 2.0f;
-			float player_right_bound = transform_comp->transform.translation.y + player_comp->width / 2.0f;
+static void build_car_index(frogger_game_t* game)
+{
+	ecs_mask_t k_car_query_mask = ecs_mask_of(game->transform_type);
+	ecs_mask_set(&k_car_query_mask, game->car_type);
 
-			float car_top_bound = car_transform_comp->transform.translation.z - car_comp->height / 2.0f;
-			float car_bottom_bound = car_transform_comp->transform.translation.z + car_comp->height / 2.0f;
-			float car_left_bound = car_transform_comp->transform.translation.y - car_comp->width / 2.0f;
-			float car_right_bound = car_transform_comp->transform.translation.y + car_comp->width / 2.0f;
+	// Cars are pooled rather than removed, so the index only goes stale when
+	// a car's transform or car component is written.
+	ecs_chunk_query_t changed = ecs_chunk_query_create_changed(game->ecs, k_car_query_mask, k_car_query_mask, game->car_index_tick);
+	if (!ecs_chunk_query_is_valid(game->ecs, &changed))
+	{
+		return;
+	}
+	game->car_index_tick = ecs_get_tick(game->ecs);
 
-			if (player_left_bound < car_right_bound
-				&& player_right_bound > car_left_bound
-				&& player_top_bound < car_bottom_bound
-				&& player_bottom_bound > car_top_bound)
+	spatial_index_clear(game->car_index);
+	for (ecs_chunk_query_t query = ecs_chunk_query_create(game->ecs, k_car_query_mask);
+		ecs_chunk_query_is_valid(game->ecs, &query);
+		ecs_chunk_query_next(game->ecs, &query))
+	{
+		const transform_component_t* transform_comps = ecs_chunk_query_get_components_read_only(game->ecs, &query, game->transform_type);
+		const car_component_t* car_comps = ecs_chunk_query_get_components_read_only(game->ecs, &query, game->car_type);
+		for (int i = 0; i < query.count; ++i)
+		{
+			if (!car_comps[i].is_enabled)
 			{
-				reset_player_position(game);
+				continue;
 			}
+
+			vec3f_t car_min = transform_comps[i].transform.translation;
+			car_min.y -= car_comps[i].width / 2.0f;
+			car_min.z -= car_comps[i].height / 2.0f;
+			vec3f_t car_max = transform_comps[i].transform.translation;
+			car_max.y += car_comps[i].width / 2.0f;
+			car_max.z += car_comps[i].height / 2.0f;
+			spatial_index_insert(game->car_index, ecs_chunk_query_get_entity(game->ecs, &query, i), car_min, car_max);
 		}
 	}
 }
@@ -563,13 +617,21 @@ static void update_cars(frogger_game_t* game)
 		}
 	}
 
-	uint64_t k_query_mask = (1ULL << game->transform_type) | (1ULL << game->car_type);
-	for (ecs_query_t query = ecs_query_create(game->ecs, k_query_mask);
-		ecs_query_is_valid(game->ecs, &query);
-		ecs_query_next(game->ecs, &query))
-	{
-		car_component_t* car_comp = ecs_query_get_component(game->ecs, &query, game->car_type);
+	game->dt = dt;
+	ecs_scheduler_run(game->scheduler);
+}
+
+static void move_cars(ecs_t* ecs, ecs_chunk_query_t* query, void* user)
+{
+	frogger_game_t* game = user;
+	float dt = game->dt;
 
+	car_component_t* car_comps = ecs_chunk_query_get_components(ecs, query, game->car_type);
+	transform_component_t* transform_comps = ecs_chunk_query_get_components(ecs, query, game->transform_type);
+
+	for (int i = 0; i < query->count; ++i)
+	{
+		car_component_t* car_comp = &car_comps[i];
 		if (!car_comp->is_enabled)
 		{
 			continue;
@@ -579,35 +641,35 @@ static void update_cars(frogger_game_t* game)
 		car_comp->time_to_live -= dt;
 		if (car_comp->time_to_live < 0)
 		{
-			disable_car(game, ecs_query_get_entity(game->ecs, &query));
+			disable_car(game, ecs_chunk_query_get_entity(ecs, query, i));
 			continue;
 		}
 
 		// slide car in the appropriate direction
-		transform_component_t* transform_comp = ecs_query_get_component(game->ecs, &query, game->transform_type);
 		transform_t move;
 		transform_identity(&move);
 		move.translation = vec3f_add(move.translation, vec3f_scale(vec3f_right(), dt * car_comp->speed));
-		transform_multiply(&transform_comp->transform, &move);
+		transform_multiply(&transform_comps[i].transform, &move);
 	}
 }
 
 static void draw_models(frogger_game_t* game)
 {
-	uint64_t k_camera_query_mask = (1ULL << game->camera_type);
+	ecs_mask_t k_camera_query_mask = ecs_mask_of(game->camera_type);
 	for (ecs_query_t camera_query = ecs_query_create(game->ecs, k_camera_query_mask);
 		ecs_query_is_valid(game->ecs, &camera_query);
 		ecs_query_next(game->ecs, &camera_query))
 	{
-		camera_component_t* camera_comp = ecs_query_get_component(game->ecs, &camera_query, game->camera_type);
+		const camera_component_t* camera_comp = ecs_query_get_component_read_only(game->ecs, &camera_query, game->camera_type);
 
-		uint64_t k_model_query_mask = (1ULL << game->transform_type) | (1ULL << game->model_type);
+		ecs_mask_t k_model_query_mask = ecs_mask_of(game->transform_type);
+		ecs_mask_set(&k_model_query_mask, game->model_type);
 		for (ecs_query_t query = ecs_query_create(game->ecs, k_model_query_mask);
 			ecs_query_is_valid(game->ecs, &query);
 			ecs_query_next(game->ecs, &query))
 		{
-			transform_component_t* transform_comp = ecs_query_get_component(game->ecs, &query, game->transform_type);
-			model_component_t* model_comp = ecs_query_get_component(game->ecs, &query, game->model_type);
+			const transform_component_t* transform_comp = ecs_query_get_component_read_only(game->ecs, &query, game->transform_type);
+			const model_component_t* model_comp = ecs_query_get_component_read_only(game->ecs, &query, game->model_type);
 			ecs_entity_ref_t entity_ref = ecs_query_get_entity(game->ecs, &query);
 
 			struct
@@ -2,6 +2,7 @@
 
 #include "event.h"
 #include "heap.h"
+#include "pool.h"
 #include "queue.h"
 #include "thread.h"
 
@@ -12,10 +13,19 @@
 
 #include "lz4/lz4.h"
 
+enum
+{
+	// Work items per pool slab. Independent of the queue depth: callers may
+	// keep finished work around long after it leaves the queues.
+	k_work_pool_slab_capacity = 64,
+};
+
 typedef struct fs_t
 {
 	heap_t* heap;
 
+	object_pool_t* work_pool;
+
 	queue_t* file_queue;
 	thread_t* file_thread;
 
@@ -42,6 +52,8 @@ typedef struct fs_work_t
 	size_t size;
 	event_t* done;
 	int result;
+	// False if the pool was exhausted and the work came from the heap.
+	bool from_pool;
 } fs_work_t;
 
 static int file_thread_func(void* user);
@@ -52,6 +64,8 @@ fs_t* fs_create(heap_t* heap, int queue_capacity)
 	fs_t* fs = heap_alloc(heap, sizeof(fs_t), 8);
 	fs->heap = heap;
 
+	fs->work_pool = object_pool_create(heap, sizeof(fs_work_t), 8, k_work_pool_slab_capacity);
+
 	fs->file_queue = queue_create(heap, queue_capacity);
 	fs->file_thread = thread_create(file_thread_func, fs);
 
@@ -71,13 +85,42 @@ void fs_destroy(fs_t* fs)
 	thread_destroy(fs->file_compression_thread);
 	queue_destroy(fs->file_compression_queue);
 
+	object_pool_destroy(fs->work_pool);
+
 	heap_free(fs->heap, fs);
 }
 
-fs_work_t* fs_read(fs_t* fs, const char* path, heap_t* heap, bool null_terminate, bool use_compression)
+static fs_work_t* work_alloc(fs_t* fs)
 {
-	fs_work_t* work = heap_alloc(fs->heap, sizeof(fs_work_t), 8);
+	fs_work_t* work = object_pool_alloc(fs->work_pool);
+	if (work)
+	{
+		work->from_pool = true;
+	}
+	else
+	{
+		work = heap_alloc(fs->heap, sizeof(fs_work_t), 8);
+		work->from_pool = false;
+	}
 	work->fs = fs;
+	return work;
+}
+
+static void work_free(fs_work_t* work)
+{
+	if (work->from_pool)
+	{
+		object_pool_free(work->fs->work_pool, work);
+	}
+	else
+	{
+		heap_free(work->fs->heap, work);
+	}
+}
+
+fs_work_t* fs_read(fs_t* fs, const char* path, heap_t* heap, bool null_terminate, bool use_compression)
+{
+	fs_work_t* work = work_alloc(fs);
 	work->heap = heap;
 	work->op = k_fs_work_op_read;
 	strcpy_s(work->path, sizeof(work->path), path);
@@ -94,8 +137,7 @@ fs_work_t* fs_read(fs_t* fs, const char* path, heap_t* heap, bool null_terminate
 
 fs_work_t* fs_write(fs_t* fs, const char* path, const void* buffer, size_t size, bool use_compression, bool append_mode)
 {
-	fs_work_t* work = heap_alloc(fs->heap, sizeof(fs_work_t), 8);
-	work->fs = fs;
+	fs_work_t* work = work_alloc(fs);
 	work->heap = fs->heap;
 	work->op = k_fs_work_op_write;
 	strcpy_s(work->path, sizeof(work->path), path);
@@ -156,7 +198,7 @@ void fs_work_destroy(fs_work_t* work)
 	{
 		event_wait(work->done);
 		event_destroy(work->done);
-		heap_free(work->heap, work);
+		work_free(work);
 	}
 }
 
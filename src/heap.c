@@ -1,11 +1,17 @@
 #include "heap.h"
 
+#include "atomic.h"
 #include "debug.h"
 #include "mutex.h"
+#include "thread.h"
 #include "tlsf/tlsf.h"
+#include "vm.h"
 
+#include <stdbool.h>
+#include <math.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <string.h>
 
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
@@ -13,36 +19,191 @@
 
 #define MAX_CALLSTACK_DEPTH 64
 #define MAX_FUNC_NAME_LENGTH 64
+#define MAX_SAMPLE_DEPTH 32
 
-typedef struct arena_t
+enum
+{
+	// Thread caches serve sizes 16, 32, 64, ... 2048 bytes.
+	k_cache_min_size_shift = 4,
+	k_cache_class_count = 8,
+	k_cache_max_size = 1 << (k_cache_min_size_shift + k_cache_class_count - 1),
+	k_cache_alignment = 16,
+
+	// Number of blocks moved between a thread cache and TLSF at once.
+	k_cache_batch_count = 32,
+	// Number of free blocks a thread cache may hold per size class.
+	k_cache_max_count = 64,
+
+	// Maximum number of threads that get their own cache at once. A cache is
+	// released when its thread exits. Threads beyond this limit use the
+	// locked path.
+	k_max_thread_caches = 64,
+
+	// Number of blocks returned to TLSF between scans for idle arenas.
+	k_arena_scan_interval = 1024,
+	// Number of consecutive scans an arena must be empty before it is released.
+	// One empty arena is always kept as a spare so the heap does not thrash
+	// between growing and shrinking.
+	k_arena_idle_scans = 2,
+
+	// alloc_header_t::size_class for blocks not owned by a thread cache.
+	k_size_class_locked = -1,
+	k_size_class_huge = -2,
+
+	// Capacity of the call site table used by the sampling profiler.
+	// Must be a power of two.
+	k_profile_max_sites = 4096,
+};
+
+typedef struct heap_arena_t
 {
 	pool_t pool;
-	struct arena_t* next;
-} arena_t;
+	struct heap_arena_t* next;
+	size_t size;
+	int idle_scans;
+} heap_arena_t;
 
+// Tracking record stored in front of the header of allocations made on the
+// locked path. Records form an intrusive doubly linked list so free is O(1).
 typedef struct alloc_t
 {
-	void* address;
-	size_t size;
+	struct alloc_t* prev;
 	struct alloc_t* next;
 
-	size_t stack_depth;
-	void* stack[MAX_CALLSTACK_DEPTH];
+	// Callstack captured at allocation time, stored at the start of the
+	// same block. NULL unless the heap was created with k_heap_flag_capture_stacks.
+	void** stack;
+	int stack_depth;
 } alloc_t;
 
+// Free block linked through its own memory while it sits in a thread cache.
+typedef struct free_block_t
+{
+	struct free_block_t* next;
+} free_block_t;
+
+// Per-thread magazine of free blocks, one list per size class.
+// Only the owning thread touches the lists; other threads hand blocks
+// back through the lock-free remote_free list.
+typedef __declspec(align(64)) struct thread_cache_t
+{
+	// Owning thread, zero while unclaimed.
+	int thread_id;
+	struct heap_t* heap;
+	int counts[k_cache_class_count];
+	free_block_t* blocks[k_cache_class_count];
+
+	free_block_t* remote_free;
+
+	size_t live_bytes;
+	int live_count;
+	int live_class_counts[k_cache_class_count];
+
+	int64_t bytes_until_sample;
+	uint64_t sample_rng;
+} thread_cache_t;
+
+// Header stored immediately in front of every allocation.
+// Aligned so that cached blocks keep 16 byte alignment for the caller.
+typedef __declspec(align(16)) struct alloc_header_t
+{
+	// Address returned by TLSF.
+	void* block;
+	// Owning thread cache, NULL if the block came from the locked path.
+	thread_cache_t* cache;
+	size_t size;
+	int size_class;
+	// Index plus one of the profile call site, zero if not sampled.
+	int sample_site;
+} alloc_header_t;
+
+// Allocations sampled from one callstack.
+// Byte counts are estimates scaled up by the sampling probability.
+typedef struct profile_site_t
+{
+	uint32_t hash;
+	int stack_depth;
+	void* stack[MAX_SAMPLE_DEPTH];
+	size_t allocated_bytes;
+	size_t allocated_count;
+	size_t live_bytes;
+	size_t live_count;
+} profile_site_t;
+
 typedef struct heap_t
 {
+	thread_cache_t caches[k_max_thread_caches];
+
 	tlsf_t tlsf;
 	size_t grow_increment;
-	arena_t* arena;
+	uint32_t flags;
+	heap_arena_t* arena;
 	alloc_t* head;
 	mutex_t* mutex;
+
+	// Fiber local storage slot holding the calling thread's cache, so the
+	// cache is released when the thread exits. FLS_OUT_OF_INDEXES if none
+	// was available, in which case caches stay claimed until heap_destroy().
+	DWORD cache_fls_index;
+
+	// Usage of the locked path. Thread caches keep their own counters.
+	size_t live_bytes;
+	size_t live_count;
+	size_t live_class_counts[k_heap_stats_size_class_count];
+	size_t peak_live_bytes;
+	int arena_count;
+	size_t arena_bytes;
+	int frees_since_scan;
+
+	// Contiguous range grown in place when heap_info_t::reserve_size is set.
+	char* reserve_base;
+	size_t reserve_size;
+	size_t reserve_committed;
+
+	// Allocations with their own page mapping. They stay on the alloc_t list.
+	size_t huge_threshold;
+	int huge_count;
+	size_t huge_bytes;
+
+	// Sampling profiler state. The sites table is NULL when sampling is disabled.
+	size_t sample_interval;
+	int64_t bytes_until_sample;
+	uint64_t sample_rng;
+	profile_site_t* sites;
+	size_t dropped_samples;
 } heap_t;
 
+static thread_cache_t* get_thread_cache(heap_t* heap, bool claim);
+static void WINAPI release_thread_cache(void* data);
+static bool add_arena(heap_t* heap, size_t size);
+static bool grow_reserve(heap_t* heap, size_t size);
+static void release_idle_arenas(heap_t* heap, bool release_all);
+static void count_tlsf_free(heap_t* heap);
+static void* tlsf_alloc_or_grow(heap_t* heap, size_t size, size_t alignment);
+static size_t huge_mapping_size(size_t size);
+static void* cache_alloc(heap_t* heap, thread_cache_t* cache, size_t size);
+static void cache_free(heap_t* heap, thread_cache_t* cache, alloc_header_t* header);
+static void cache_drain_remote(heap_t* heap, thread_cache_t* cache);
+static void cache_refill(heap_t* heap, thread_cache_t* cache, int size_class);
+static void cache_release(heap_t* heap, thread_cache_t* cache, int size_class, int count);
+static int size_to_class(size_t size);
+static void update_peak(heap_t* heap);
+static bool should_sample(heap_t* heap, int64_t* bytes_until_sample, uint64_t* rng, size_t size);
+static int record_sample(heap_t* heap, size_t size);
+static void release_sample(heap_t* heap, int sample_site, size_t size);
+
 heap_t* heap_create(size_t grow_increment)
 {
-	heap_t* heap = VirtualAlloc(NULL, sizeof(heap_t) + tlsf_size(),
-		MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	heap_info_t info =
+	{
+		.grow_increment = grow_increment,
+	};
+	return heap_create_with_info(&info);
+}
+
+heap_t* heap_create_with_info(const heap_info_t* info)
+{
+	heap_t* heap = vm_alloc(sizeof(heap_t) + tlsf_size());
 	if (!heap)
 	{
 		debug_print(
@@ -51,55 +212,130 @@ heap_t* heap_create(size_t grow_increment)
 		return NULL;
 	}
 
+	// New pages are zeroed, so thread caches start unclaimed and empty.
 	heap->mutex = mutex_create();
-	heap->grow_increment = grow_increment;
+	heap->grow_increment = info->grow_increment;
+	heap->flags = info->flags;
 	heap->tlsf = tlsf_create(heap + 1);
+	heap->cache_fls_index = FlsAlloc(release_thread_cache);
 	heap->arena = NULL;
 	heap->head = NULL;
+	heap->huge_threshold = info->huge_threshold ? info->huge_threshold : info->grow_increment / 2;
+
+	if (info->reserve_size)
+	{
+		size_t page_size = vm_page_size();
+		heap->reserve_size = (info->reserve_size + (page_size - 1)) & ~(page_size - 1);
+		heap->reserve_base = vm_reserve(heap->reserve_size);
+		if (!heap->reserve_base)
+		{
+			debug_print(
+				k_print_warning,
+				"Unable to reserve %zu bytes for heap.\n",
+				heap->reserve_size);
+			heap->reserve_size = 0;
+		}
+	}
+
+	if (info->sample_interval)
+	{
+		heap->sites = vm_alloc(sizeof(profile_site_t) * k_profile_max_sites);
+		if (heap->sites)
+		{
+			heap->sample_interval = info->sample_interval;
+		}
+	}
 
 	return heap;
 }
 
 void* heap_alloc(heap_t* heap, size_t size, size_t alignment)
 {
-	mutex_lock(heap->mutex);
+	// Stack capture needs a full tracking record, so it bypasses thread caches.
+	if (size <= k_cache_max_size && alignment <= k_cache_alignment &&
+		(heap->flags & k_heap_flag_capture_stacks) == 0)
+	{
+		thread_cache_t* cache = get_thread_cache(heap, true);
+		if (cache)
+		{
+			return cache_alloc(heap, cache, size);
+		}
+	}
 
-	void* address = tlsf_memalign(heap->tlsf, alignment, size);
-	if (!address)
+	if (alignment < sizeof(void*))
+	{
+		alignment = sizeof(void*);
+	}
+	size_t stack_size = (heap->flags & k_heap_flag_capture_stacks) ? sizeof(void*) * MAX_CALLSTACK_DEPTH : 0;
+	size_t header_size = stack_size + sizeof(alloc_t) + sizeof(alloc_header_t);
+	size_t header_offset = (header_size + (alignment - 1)) & ~(alignment - 1);
+
+	// Map huge blocks before taking the lock; it is a system call.
+	// Page mappings only guarantee page alignment.
+	void* block = NULL;
+	size_t huge_size = 0;
+	if (size >= heap->huge_threshold && alignment <= vm_page_size())
 	{
-		size_t arena_size =
-			__max(heap->grow_increment, size * 2) +
-			sizeof(arena_t);
-		arena_t* arena = VirtualAlloc(NULL,
-			arena_size + tlsf_pool_overhead(),
-			MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
-		if (!arena)
+		huge_size = huge_mapping_size(header_offset + size);
+		block = vm_alloc(huge_size);
+		if (!block)
 		{
 			debug_print(
 				k_print_error,
 				"OUT OF MEMORY!\n");
 			return NULL;
 		}
+	}
 
-		arena->pool = tlsf_add_pool(heap->tlsf, arena + 1, arena_size);
-
-		arena->next = heap->arena;
-		heap->arena = arena;
+	mutex_lock(heap->mutex);
 
-		address = tlsf_memalign(heap->tlsf, alignment, size);
+	if (!huge_size)
+	{
+		block = tlsf_alloc_or_grow(heap, header_offset + size, alignment);
 	}
+	void* address = NULL;
 
-	if (address)
+	if (block)
 	{
-		alloc_t* new_alloc = malloc(sizeof(alloc_t));
-		new_alloc->address = address;
-		new_alloc->size = size;
-		new_alloc->next = heap->head;
+		address = (char*)block + header_offset;
+
+		alloc_header_t* header = (alloc_header_t*)address - 1;
+		header->block = block;
+		header->cache = NULL;
+		header->size = size;
+		header->size_class = huge_size ? k_size_class_huge : k_size_class_locked;
+		header->sample_site = 0;
+		if (heap->sample_interval && should_sample(heap, &heap->bytes_until_sample, &heap->sample_rng, size))
+		{
+			header->sample_site = record_sample(heap, size);
+		}
+
+		alloc_t* alloc = (alloc_t*)header - 1;
+		alloc->stack = NULL;
+		alloc->stack_depth = 0;
+		if (stack_size)
+		{
+			alloc->stack = block;
+			alloc->stack_depth = CaptureStackBackTrace(0, MAX_CALLSTACK_DEPTH, alloc->stack, NULL);
+		}
 
-		int count = CaptureStackBackTrace(0, MAX_CALLSTACK_DEPTH, new_alloc->stack, NULL);
-		new_alloc->stack_depth = (count < MAX_CALLSTACK_DEPTH) ? count : MAX_CALLSTACK_DEPTH;
+		alloc->prev = NULL;
+		alloc->next = heap->head;
+		if (heap->head)
+		{
+			heap->head->prev = alloc;
+		}
+		heap->head = alloc;
 
-		heap->head = new_alloc;
+		heap->live_bytes += size;
+		heap->live_count++;
+		heap->live_class_counts[size_to_class(size)]++;
+		if (huge_size)
+		{
+			heap->huge_count++;
+			heap->huge_bytes += huge_size;
+		}
+		update_peak(heap);
 	}
 
 	mutex_unlock(heap->mutex);
@@ -109,33 +345,126 @@ void* heap_alloc(heap_t* heap, size_t size, size_t alignment)
 
 void heap_free(heap_t* heap, void* address)
 {
-	mutex_lock(heap->mutex);
-
-	tlsf_free(heap->tlsf, address);
+	if (!address)
+	{
+		return;
+	}
 
-	alloc_t* prev = NULL;
-	alloc_t* alloc = heap->head;
+	alloc_header_t* header = (alloc_header_t*)address - 1;
 
-	while (alloc)
+	thread_cache_t* cache = header->cache;
+	if (cache)
 	{
-		if (alloc->address == address)
+		if (cache->thread_id == get_current_thread_id())
 		{
-			if (!prev)
-			{
-				heap->head = alloc->next;
-			}
-			else
+			cache_free(heap, cache, header);
+		}
+		else
+		{
+			// Return the block to its owner without taking any lock.
+			free_block_t* node = address;
+			free_block_t* head;
+			do
 			{
-				prev->next = alloc->next;
-			}
+				head = atomic_load_pointer((void**)&cache->remote_free);
+				node->next = head;
+			} while (atomic_compare_and_exchange_pointer((void**)&cache->remote_free, head, node) != head);
+		}
+		return;
+	}
 
-			break;
+	mutex_lock(heap->mutex);
+
+	alloc_t* alloc = (alloc_t*)header - 1;
+	if (alloc->prev)
+	{
+		alloc->prev->next = alloc->next;
+	}
+	else
+	{
+		heap->head = alloc->next;
+	}
+	if (alloc->next)
+	{
+		alloc->next->prev = alloc->prev;
+	}
+
+	heap->live_bytes -= header->size;
+	heap->live_count--;
+	heap->live_class_counts[size_to_class(header->size)]--;
+
+	if (header->sample_site)
+	{
+		release_sample(heap, header->sample_site, header->size);
+	}
+
+	if (header->size_class == k_size_class_huge)
+	{
+		size_t huge_size = huge_mapping_size((char*)address - (char*)header->block + header->size);
+		heap->huge_count--;
+		heap->huge_bytes -= huge_size;
+		mutex_unlock(heap->mutex);
+
+		vm_release(header->block, huge_size);
+		return;
+	}
+
+	tlsf_free(heap->tlsf, header->block);
+	count_tlsf_free(heap);
+
+	mutex_unlock(heap->mutex);
+}
+
+void heap_trim(heap_t* heap)
+{
+	thread_cache_t* cache = get_thread_cache(heap, false);
+	if (cache)
+	{
+		cache_drain_remote(heap, cache);
+		for (int i = 0; i < k_cache_class_count; ++i)
+		{
+			cache_release(heap, cache, i, cache->counts[i]);
 		}
+	}
 
-		prev = alloc;
-		alloc = alloc->next;
+	mutex_lock(heap->mutex);
+	release_idle_arenas(heap, true);
+	mutex_unlock(heap->mutex);
+}
+
+void heap_get_stats(heap_t* heap, heap_stats_t* stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	mutex_lock(heap->mutex);
+
+	update_peak(heap);
+
+	stats->live_bytes = heap->live_bytes;
+	stats->allocation_count = heap->live_count;
+	for (int i = 0; i < _countof(stats->size_class_counts); ++i)
+	{
+		stats->size_class_counts[i] = heap->live_class_counts[i];
+	}
+
+	for (int i = 0; i < _countof(heap->caches); ++i)
+	{
+		thread_cache_t* cache = &heap->caches[i];
+		stats->live_bytes += cache->live_bytes;
+		stats->allocation_count += cache->live_count;
+		for (int c = 0; c < k_cache_class_count; ++c)
+		{
+			stats->size_class_counts[c] += cache->live_class_counts[c];
+		}
 	}
 
+	stats->peak_live_bytes = heap->peak_live_bytes;
+	stats->arena_count = heap->arena_count;
+	stats->arena_bytes = heap->arena_bytes;
+	stats->largest_free_block = tlsf_largest_free_block(heap->tlsf);
+	stats->huge_count = heap->huge_count;
+	stats->huge_bytes = heap->huge_bytes;
+
 	mutex_unlock(heap->mutex);
 }
 
@@ -154,14 +483,25 @@ void detect_and_report_leaks(heap_t* heap)
 	alloc_t* alloc = heap->head;
 	while (alloc)
 	{
+		alloc_header_t* header = (alloc_header_t*)(alloc + 1);
+		if (!alloc->stack)
+		{
+			debug_print(
+				k_print_error,
+				"Memory leak of size %zu bytes (no callstack)\n",
+				header->size);
+			alloc = alloc->next;
+			continue;
+		}
+
 		debug_print(
 			k_print_error,
-			"Memory leak of size %d bytes with callstack:\n",
-			alloc->size);
+			"Memory leak of size %zu bytes with callstack:\n",
+			header->size);
 
 		// print the callstack, ignoring the first 7 stack frames since they preceed main
-		size_t stack_count = 0;
-		for (size_t stack_index = alloc->stack_depth - 7; stack_index >= 1; --stack_index)
+		int stack_count = 0;
+		for (int stack_index = alloc->stack_depth - 7; stack_index >= 1; --stack_index)
 		{
 			DWORD64 address = (DWORD64)(alloc->stack[stack_index]);
 
@@ -178,6 +518,20 @@ void detect_and_report_leaks(heap_t* heap)
 		alloc = alloc->next;
 	}
 
+	// Thread caches do not capture callstacks; report what they still hold.
+	for (int i = 0; i < _countof(heap->caches); ++i)
+	{
+		thread_cache_t* cache = &heap->caches[i];
+		cache_drain_remote(heap, cache);
+		if (cache->live_count)
+		{
+			debug_print(
+				k_print_error,
+				"Memory leak of size %zu bytes in %d allocations from thread %d (no callstack)\n",
+				cache->live_bytes, cache->live_count, cache->thread_id);
+		}
+	}
+
 	mutex_unlock(heap->mutex);
 
 	SymCleanup(process_id);
@@ -185,19 +539,528 @@ void detect_and_report_leaks(heap_t* heap)
 
 void heap_destroy(heap_t* heap)
 {
+	// Releases the caches of threads still holding one.
+	if (heap->cache_fls_index != FLS_OUT_OF_INDEXES)
+	{
+		FlsFree(heap->cache_fls_index);
+	}
+
 	detect_and_report_leaks(heap);
 
 	tlsf_destroy(heap->tlsf);
 
-	arena_t* arena = heap->arena;
+	heap_arena_t* arena = heap->arena;
 	while (arena)
 	{
-		arena_t* next = arena->next;
-		VirtualFree(arena, 0, MEM_RELEASE);
+		heap_arena_t* next = arena->next;
+		vm_release(arena, arena->size);
 		arena = next;
 	}
 
+	if (heap->reserve_base)
+	{
+		vm_release(heap->reserve_base, heap->reserve_size);
+	}
+
+	if (heap->sites)
+	{
+		vm_release(heap->sites, sizeof(profile_site_t) * k_profile_max_sites);
+	}
+
 	mutex_destroy(heap->mutex);
 
-	VirtualFree(heap, 0, MEM_RELEASE);
+	vm_release(heap, sizeof(heap_t) + tlsf_size());
+}
+
+// Returns the calling thread's cache. If it has none, claims a free one when
+// claim is true, and otherwise returns NULL.
+static thread_cache_t* get_thread_cache(heap_t* heap, bool claim)
+{
+	// The FLS slot holds the thread's cache, so a cache released out from
+	// in front of it on the probe sequence cannot cause a second claim.
+	if (heap->cache_fls_index != FLS_OUT_OF_INDEXES)
+	{
+		thread_cache_t* cache = FlsGetValue(heap->cache_fls_index);
+		if (cache || !claim)
+		{
+			return cache;
+		}
+	}
+
+	int thread_id = get_current_thread_id();
+	unsigned int start = (unsigned int)thread_id * 2654435761u;
+	for (int i = 0; i < _countof(heap->caches); ++i)
+	{
+		thread_cache_t* cache = &heap->caches[(start + i) % _countof(heap->caches)];
+		int owner = atomic_load(&cache->thread_id);
+		if (owner == thread_id)
+		{
+			return cache;
+		}
+		if (!claim)
+		{
+			continue;
+		}
+		if (owner == 0 && atomic_compare_and_exchange(&cache->thread_id, 0, thread_id) == 0)
+		{
+			cache->heap = heap;
+			if (heap->cache_fls_index != FLS_OUT_OF_INDEXES)
+			{
+				FlsSetValue(heap->cache_fls_index, cache);
+			}
+			return cache;
+		}
+	}
+	return NULL;
+}
+
+// Called on a thread's exit, or by heap_destroy(), with the cache the thread
+// claimed. Returns every cached block to TLSF and unclaims the cache so another
+// thread can take it. Blocks still allocated from the cache stay valid: frees
+// from other threads keep arriving on remote_free and are drained by the next
+// owner, which also inherits the cache's live counters.
+static void WINAPI release_thread_cache(void* data)
+{
+	thread_cache_t* cache = data;
+	heap_t* heap = cache->heap;
+
+	cache_drain_remote(heap, cache);
+	for (int i = 0; i < k_cache_class_count; ++i)
+	{
+		cache_release(heap, cache, i, cache->counts[i]);
+	}
+
+	atomic_store(&cache->thread_id, 0);
+}
+
+static bool add_arena(heap_t* heap, size_t size)
+{
+	if (heap->reserve_base && grow_reserve(heap, size))
+	{
+		return true;
+	}
+
+	size_t pool_size =
+		__max(heap->grow_increment, size * 2) +
+		tlsf_pool_overhead();
+	size_t arena_size = sizeof(heap_arena_t) + pool_size;
+	heap_arena_t* arena = vm_alloc(arena_size);
+	if (!arena)
+	{
+		debug_print(
+			k_print_error,
+			"OUT OF MEMORY!\n");
+		return false;
+	}
+
+	arena->pool = tlsf_add_pool(heap->tlsf, arena + 1, pool_size);
+	arena->size = arena_size;
+	arena->idle_scans = 0;
+
+	arena->next = heap->arena;
+	heap->arena = arena;
+
+	heap->arena_count++;
+	heap->arena_bytes += arena_size;
+	return true;
+}
+
+// Commits more of the reserved range and grows the TLSF pool living in it.
+// Must be called with the heap mutex held.
+static bool grow_reserve(heap_t* heap, size_t size)
+{
+	size_t page_size = vm_page_size();
+	size_t commit_size = __max(heap->grow_increment, size + tlsf_pool_overhead());
+	commit_size = (commit_size + (page_size - 1)) & ~(page_size - 1);
+	if (heap->reserve_committed + commit_size > heap->reserve_size)
+	{
+		return false;
+	}
+
+	char* address = heap->reserve_base + heap->reserve_committed;
+	if (!vm_commit(address, commit_size))
+	{
+		return false;
+	}
+
+	bool added = heap->reserve_committed == 0 ?
+		tlsf_add_pool(heap->tlsf, address, commit_size) != NULL :
+		tlsf_extend_pool(heap->tlsf, heap->reserve_base, heap->reserve_committed, commit_size) != 0;
+	if (!added)
+	{
+		// TLSF cannot manage a pool this large; fall back to arenas.
+		vm_decommit(address, commit_size);
+		return false;
+	}
+	if (heap->reserve_committed == 0)
+	{
+		heap->arena_count++;
+	}
+
+	heap->reserve_committed += commit_size;
+	heap->arena_bytes += commit_size;
+	return true;
+}
+
+// Must be called with the heap mutex held.
+static void release_idle_arenas(heap_t* heap, bool release_all)
+{
+	bool kept_spare = false;
+
+	heap_arena_t** link = &heap->arena;
+	while (*link)
+	{
+		heap_arena_t* arena = *link;
+		if (!tlsf_pool_is_empty(arena->pool))
+		{
+			arena->idle_scans = 0;
+			link = &arena->next;
+			continue;
+		}
+
+		arena->idle_scans++;
+		if (!release_all && (!kept_spare || arena->idle_scans < k_arena_idle_scans))
+		{
+			kept_spare = true;
+			link = &arena->next;
+			continue;
+		}
+
+		*link = arena->next;
+		tlsf_remove_pool(heap->tlsf, arena->pool);
+		heap->arena_count--;
+		heap->arena_bytes -= arena->size;
+		vm_release(arena, arena->size);
+	}
+}
+
+// Must be called with the heap mutex held.
+static void count_tlsf_free(heap_t* heap)
+{
+	if (++heap->frees_since_scan >= k_arena_scan_interval)
+	{
+		heap->frees_since_scan = 0;
+		release_idle_arenas(heap, false);
+	}
+}
+
+// Must be called with the heap mutex held.
+static void* tlsf_alloc_or_grow(heap_t* heap, size_t size, size_t alignment)
+{
+	void* address = tlsf_memalign(heap->tlsf, alignment, size);
+	if (!address && add_arena(heap, size + alignment))
+	{
+		address = tlsf_memalign(heap->tlsf, alignment, size);
+	}
+	return address;
+}
+
+// Size of the page mapping backing a huge allocation.
+static size_t huge_mapping_size(size_t size)
+{
+	size_t page_size = vm_page_size();
+	return (size + (page_size - 1)) & ~(page_size - 1);
+}
+
+// Thread cache size classes match the first buckets of heap_stats_t::size_class_counts.
+static int size_to_class(size_t size)
+{
+	int size_class = 0;
+	size_t class_size = (size_t)1 << k_cache_min_size_shift;
+	while (class_size < size && size_class < k_heap_stats_size_class_count - 1)
+	{
+		class_size <<= 1;
+		++size_class;
+	}
+	return size_class;
+}
+
+// Must be called with the heap mutex held.
+static void update_peak(heap_t* heap)
+{
+	size_t live_bytes = heap->live_bytes;
+	for (int i = 0; i < _countof(heap->caches); ++i)
+	{
+		live_bytes += heap->caches[i].live_bytes;
+	}
+	heap->peak_live_bytes = __max(heap->peak_live_bytes, live_bytes);
+}
+
+static size_t class_to_size(int size_class)
+{
+	return (size_t)1 << (k_cache_min_size_shift + size_class);
+}
+
+static void* cache_alloc(heap_t* heap, thread_cache_t* cache, size_t size)
+{
+	int size_class = size_to_class(size);
+
+	if (!cache->blocks[size_class])
+	{
+		cache_drain_remote(heap, cache);
+	}
+	if (!cache->blocks[size_class])
+	{
+		cache_refill(heap, cache, size_class);
+	}
+
+	free_block_t* block = cache->blocks[size_class];
+	if (!block)
+	{
+		return NULL;
+	}
+	cache->blocks[size_class] = block->next;
+	cache->counts[size_class]--;
+
+	alloc_header_t* header = (alloc_header_t*)block - 1;
+	header->size = size;
+	header->sample_site = 0;
+	if (heap->sample_interval && should_sample(heap, &cache->bytes_until_sample, &cache->sample_rng, size))
+	{
+		mutex_lock(heap->mutex);
+		header->sample_site = record_sample(heap, size);
+		mutex_unlock(heap->mutex);
+	}
+
+	cache->live_bytes += size;
+	cache->live_count++;
+	cache->live_class_counts[size_class]++;
+
+	return block;
+}
+
+static void cache_free(heap_t* heap, thread_cache_t* cache, alloc_header_t* header)
+{
+	int size_class = header->size_class;
+
+	cache->live_bytes -= header->size;
+	cache->live_count--;
+	cache->live_class_counts[size_class]--;
+
+	if (header->sample_site)
+	{
+		mutex_lock(heap->mutex);
+		release_sample(heap, header->sample_site, header->size);
+		mutex_unlock(heap->mutex);
+	}
+
+	free_block_t* block = (free_block_t*)(header + 1);
+	block->next = cache->blocks[size_class];
+	cache->blocks[size_class] = block;
+
+	if (++cache->counts[size_class] > k_cache_max_count)
+	{
+		cache_release(heap, cache, size_class, k_cache_batch_count);
+	}
+}
+
+static void cache_drain_remote(heap_t* heap, thread_cache_t* cache)
+{
+	free_block_t* block = atomic_exchange_pointer((void**)&cache->remote_free, NULL);
+	while (block)
+	{
+		free_block_t* next = block->next;
+		cache_free(heap, cache, (alloc_header_t*)block - 1);
+		block = next;
+	}
+}
+
+static void cache_refill(heap_t* heap, thread_cache_t* cache, int size_class)
+{
+	size_t block_size = sizeof(alloc_header_t) + class_to_size(size_class);
+
+	mutex_lock(heap->mutex);
+
+	for (int i = 0; i < k_cache_batch_count; ++i)
+	{
+		void* address = tlsf_alloc_or_grow(heap, block_size, k_cache_alignment);
+		if (!address)
+		{
+			break;
+		}
+
+		alloc_header_t* header = address;
+		header->block = address;
+		header->cache = cache;
+		header->size = 0;
+		header->size_class = size_class;
+
+		free_block_t* block = (free_block_t*)(header + 1);
+		block->next = cache->blocks[size_class];
+		cache->blocks[size_class] = block;
+		cache->counts[size_class]++;
+	}
+
+	update_peak(heap);
+
+	mutex_unlock(heap->mutex);
+}
+
+static void cache_release(heap_t* heap, thread_cache_t* cache, int size_class, int count)
+{
+	mutex_lock(heap->mutex);
+
+	for (int i = 0; i < count && cache->blocks[size_class]; ++i)
+	{
+		free_block_t* block = cache->blocks[size_class];
+		cache->blocks[size_class] = block->next;
+		cache->counts[size_class]--;
+
+		alloc_header_t* header = (alloc_header_t*)block - 1;
+		tlsf_free(heap->tlsf, header->block);
+		count_tlsf_free(heap);
+	}
+
+	mutex_unlock(heap->mutex);
+}
+
+static int64_t next_sample_interval(heap_t* heap, uint64_t* rng)
+{
+	*rng ^= *rng << 13;
+	*rng ^= *rng >> 7;
+	*rng ^= *rng << 17;
+
+	// Exponentially distributed gaps make sampling a Poisson process over
+	// allocated bytes, so every byte has the same chance of being sampled.
+	double uniform = ((*rng >> 11) + 1) * (1.0 / 9007199254740992.0);
+	return (int64_t)(-log(uniform) * (double)heap->sample_interval) + 1;
+}
+
+static bool should_sample(heap_t* heap, int64_t* bytes_until_sample, uint64_t* rng, size_t size)
+{
+	if (!*rng)
+	{
+		*rng = ((uint64_t)(uintptr_t)rng * 0x9E3779B97F4A7C15ull) | 1;
+		*bytes_until_sample = next_sample_interval(heap, rng);
+	}
+
+	*bytes_until_sample -= size;
+	if (*bytes_until_sample > 0)
+	{
+		return false;
+	}
+
+	*bytes_until_sample = next_sample_interval(heap, rng);
+	return true;
+}
+
+// Estimate of the bytes represented by one sampled allocation of the given size.
+static size_t sample_weight(heap_t* heap, size_t size)
+{
+	double probability = 1.0 - exp(-(double)size / (double)heap->sample_interval);
+	return (size_t)((double)size / probability);
+}
+
+// Must be called with the heap mutex held.
+static int record_sample(heap_t* heap, size_t size)
+{
+	void* stack[MAX_SAMPLE_DEPTH];
+	int stack_depth = CaptureStackBackTrace(1, MAX_SAMPLE_DEPTH, stack, NULL);
+
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < stack_depth; ++i)
+	{
+		hash = (hash ^ (uint32_t)((uintptr_t)stack[i] >> 4)) * 16777619u;
+	}
+
+	for (int i = 0; i < k_profile_max_sites; ++i)
+	{
+		int index = (hash + i) & (k_profile_max_sites - 1);
+		profile_site_t* site = &heap->sites[index];
+		if (site->allocated_count == 0)
+		{
+			site->hash = hash;
+			site->stack_depth = stack_depth;
+			memcpy(site->stack, stack, sizeof(void*) * stack_depth);
+		}
+		else if (site->hash != hash ||
+			site->stack_depth != stack_depth ||
+			memcmp(site->stack, stack, sizeof(void*) * stack_depth) != 0)
+		{
+			continue;
+		}
+
+		size_t weight = sample_weight(heap, size);
+		site->allocated_bytes += weight;
+		site->allocated_count++;
+		site->live_bytes += weight;
+		site->live_count++;
+		return index + 1;
+	}
+
+	heap->dropped_samples++;
+	return 0;
+}
+
+// Must be called with the heap mutex held.
+static void release_sample(heap_t* heap, int sample_site, size_t size)
+{
+	profile_site_t* site = &heap->sites[sample_site - 1];
+	site->live_bytes -= sample_weight(heap, size);
+	site->live_count--;
+}
+
+bool heap_write_profile(heap_t* heap, const char* path, heap_profile_t profile)
+{
+	if (!heap->sites)
+	{
+		return false;
+	}
+
+	FILE* file = NULL;
+	if (fopen_s(&file, path, "w") != 0 || !file)
+	{
+		debug_print(k_print_warning, "Unable to write heap profile: %s\n", path);
+		return false;
+	}
+
+	SymSetOptions(SYMOPT_UNDNAME | SYMOPT_DEFERRED_LOADS);
+
+	void* process_id = GetCurrentProcess();
+	if (!SymInitialize(process_id, NULL, TRUE))
+	{
+		debug_print(k_print_error, "SymInitialize returned error : %d\n", GetLastError());
+	}
+
+	mutex_lock(heap->mutex);
+
+	for (int i = 0; i < k_profile_max_sites; ++i)
+	{
+		profile_site_t* site = &heap->sites[i];
+		size_t bytes = (profile == k_heap_profile_live_bytes) ? site->live_bytes : site->allocated_bytes;
+		if (!site->allocated_count || !bytes)
+		{
+			continue;
+		}
+
+		// Folded stacks list the outermost frame first.
+		for (int stack_index = site->stack_depth - 1; stack_index >= 0; --stack_index)
+		{
+			char symbol_buffer[sizeof(SYMBOL_INFO) + (MAX_FUNC_NAME_LENGTH - 1) * sizeof(TCHAR)];
+			SYMBOL_INFO* symbol = (SYMBOL_INFO*)symbol_buffer;
+			symbol->MaxNameLen = MAX_FUNC_NAME_LENGTH;
+			symbol->SizeOfStruct = sizeof(SYMBOL_INFO);
+
+			if (SymFromAddr(process_id, (DWORD64)site->stack[stack_index], NULL, symbol))
+			{
+				fprintf(file, "%s%s", symbol->Name, stack_index ? ";" : "");
+			}
+			else
+			{
+				fprintf(file, "%p%s", site->stack[stack_index], stack_index ? ";" : "");
+			}
+		}
+		fprintf(file, " %zu\n", bytes);
+	}
+
+	if (heap->dropped_samples)
+	{
+		debug_print(k_print_warning, "Heap profile dropped %zu samples; call site table is full.\n", heap->dropped_samples);
+	}
+
+	mutex_unlock(heap->mutex);
+
+	SymCleanup(process_id);
+	fclose(file);
+	return true;
 }
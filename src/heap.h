@@ -1,20 +1,102 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 // Heap Memory Manager
 // 
 // Main object, heap_t, represents a dynamic memory heap.
 // Once created, memory can be allocated and free from the heap.
+//
+// Small allocations are served from per-thread caches. Up to 64 threads hold
+// a cache at a time; a thread's cache is returned to the heap when the thread
+// exits, and threads beyond the limit use a slower locked path.
 
 // Handle to a heap.
 typedef struct heap_t heap_t;
 
+// Flags for heap_info_t.
+typedef enum heap_flags_t
+{
+	// Capture a callstack for every allocation so leaks are reported with their origin.
+	// Expensive: allocations skip the per-thread caches while enabled.
+	k_heap_flag_capture_stacks = 1 << 0,
+} heap_flags_t;
+
+// Parameters for heap_create_with_info().
+typedef struct heap_info_t
+{
+	// Default size with which the heap grows.
+	// Should be a multiple of OS page size.
+	size_t grow_increment;
+	// Mask of heap_flags_t.
+	uint32_t flags;
+	// If nonzero, the heap reserves this many bytes of contiguous address
+	// space up front and commits it in grow_increment steps as needed,
+	// growing one memory arena in place instead of adding new ones.
+	// Once the reservation is exhausted, the heap falls back to adding arenas.
+	size_t reserve_size;
+	// If nonzero, enables the sampling allocation profiler. On average one
+	// callstack is recorded per sample_interval bytes allocated, and samples
+	// are aggregated by call site. See heap_write_profile().
+	size_t sample_interval;
+	// Allocations of at least this many bytes bypass the heap's arenas and
+	// get a dedicated page mapping, returned to the OS as soon as they are
+	// freed. If zero, defaults to half of grow_increment, the point at which
+	// an allocation would otherwise force an oversized arena.
+	size_t huge_threshold;
+} heap_info_t;
+
+// Which quantity heap_write_profile() reports per call site.
+typedef enum heap_profile_t
+{
+	// Estimated bytes currently allocated and not yet freed.
+	k_heap_profile_live_bytes,
+	// Estimated bytes allocated since the heap was created.
+	k_heap_profile_allocated_bytes,
+} heap_profile_t;
+
+enum
+{
+	// Number of buckets in heap_stats_t::size_class_counts.
+	k_heap_stats_size_class_count = 28,
+};
+
+// Snapshot of heap usage filled in by heap_get_stats().
+typedef struct heap_stats_t
+{
+	// Bytes currently allocated by callers, excluding heap overhead.
+	size_t live_bytes;
+	// Highest observed value of live_bytes.
+	// Sampled when a thread cache refills and on heap_get_stats(), so short
+	// spikes served entirely from thread caches may be missed.
+	size_t peak_live_bytes;
+	// Number of live allocations.
+	size_t allocation_count;
+	// Live allocations per size class. Class 0 holds sizes up to 16 bytes;
+	// class N holds sizes in (16 << (N - 1), 16 << N]. The last class also
+	// holds anything larger.
+	size_t size_class_counts[k_heap_stats_size_class_count];
+	// Number of memory arenas the heap has grown into, and their total size.
+	int arena_count;
+	size_t arena_bytes;
+	// Size of the largest free block; the biggest allocation possible without growing.
+	size_t largest_free_block;
+	// Number of live allocations above the huge threshold, and the total size
+	// of their page mappings. These are not part of arena_bytes.
+	int huge_count;
+	size_t huge_bytes;
+} heap_stats_t;
+
 // Creates a new memory heap.
 // The grow increment is the default size with which the heap grows.
 // Should be a multiple of OS page size.
 heap_t* heap_create(size_t grow_increment);
 
+// Creates a new memory heap with extended options.
+heap_t* heap_create_with_info(const heap_info_t* info);
+
 // Destroy a previously created heap.
 void heap_destroy(heap_t* heap);
 
@@ -23,3 +105,23 @@ void* heap_alloc(heap_t* heap, size_t size, size_t alignment);
 
 // Free memory previously allocated from a heap.
 void heap_free(heap_t* heap, void* address);
+
+// Return memory the heap no longer needs to the OS.
+// Flushes the calling thread's allocation cache, then releases every arena
+// that holds no allocations. Free blocks cached by other threads keep their
+// arenas alive.
+void heap_trim(heap_t* heap);
+
+// Write the sampling allocation profile to a file in folded-stack format:
+// one line per call site, frames from outermost to innermost separated by
+// semicolons, followed by a space and the estimated byte count. The output
+// can be fed directly to flamegraph.pl or speedscope.
+// Returns false if the heap was created without a sample_interval or the
+// file cannot be written.
+bool heap_write_profile(heap_t* heap, const char* path, heap_profile_t profile);
+
+// Report usage and fragmentation statistics for a heap.
+// Cheap enough to call every frame. Counters owned by thread caches are read
+// without synchronization, so results are approximate while other threads
+// are allocating.
+void heap_get_stats(heap_t* heap, heap_stats_t* stats);
@@ -0,0 +1,486 @@
+#include "heap_bench.h"
+
+#include "arena.h"
+#include "debug.h"
+#include "event.h"
+#include "heap.h"
+#include "queue.h"
+#include "thread.h"
+#include "timer.h"
+#include "vm.h"
+
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <psapi.h>
+
+enum
+{
+	k_bench_iterations = 2000,
+	k_bench_batch_count = 64,
+	k_bench_max_threads = 32,
+
+	// Mirrors the render path: a small command plus a copy of its uniform data.
+	k_bench_frame_count = 1000,
+	k_bench_commands_per_frame = 512,
+	k_bench_command_size = 48,
+	k_bench_uniform_size = 192,
+
+	// Allocation pattern suite.
+	k_suite_frame_count = 200,
+	k_suite_objects_per_frame = 1000,
+	k_suite_mixed_ops = 100000,
+	k_suite_mixed_live = 2048,
+	k_suite_aligned_ops = 100000,
+	k_suite_aligned_live = 256,
+	k_suite_transfer_count = 100000,
+	k_suite_transfer_queue_capacity = 1024,
+	// Every op is timed while the latency buffer has room.
+	k_suite_max_latencies = 1 << 20,
+	// Working set is sampled once per this many ops.
+	k_suite_rss_interval = 1024,
+};
+
+// Allocator under test. The suite runs every pattern against each one.
+typedef struct bench_allocator_t
+{
+	const char* name;
+	void* (*alloc)(void* context, size_t size, size_t alignment);
+	void (*free)(void* context, void* address);
+	void* context;
+} bench_allocator_t;
+
+// Measurements for one pattern run against one allocator.
+typedef struct bench_run_t
+{
+	bench_allocator_t* allocator;
+	uint64_t* latencies;
+	int latency_count;
+	int latency_capacity;
+	size_t base_rss;
+	size_t peak_rss;
+} bench_run_t;
+
+typedef struct bench_thread_data_t
+{
+	heap_t* heap;
+	event_t* start;
+} bench_thread_data_t;
+
+static int alloc_free_func(void* user)
+{
+	bench_thread_data_t* thread_data = user;
+	event_wait(thread_data->start);
+
+	static const size_t k_sizes[] = { 16, 24, 48, 64, 128, 256, 1040 };
+
+	void* blocks[k_bench_batch_count];
+	for (int i = 0; i < k_bench_iterations; ++i)
+	{
+		for (int j = 0; j < _countof(blocks); ++j)
+		{
+			blocks[j] = heap_alloc(thread_data->heap, k_sizes[(i + j) % _countof(k_sizes)], 8);
+		}
+		for (int j = 0; j < _countof(blocks); ++j)
+		{
+			heap_free(thread_data->heap, blocks[j]);
+		}
+	}
+
+	return 0;
+}
+
+void heap_bench_thread_scaling(int max_threads)
+{
+	if (max_threads > k_bench_max_threads)
+	{
+		max_threads = k_bench_max_threads;
+	}
+
+	for (int thread_count = 1; thread_count <= max_threads; ++thread_count)
+	{
+		bench_thread_data_t thread_data =
+		{
+			.heap = heap_create(2 * 1024 * 1024),
+			.start = event_create(),
+		};
+
+		thread_t* threads[k_bench_max_threads];
+		for (int i = 0; i < thread_count; ++i)
+		{
+			threads[i] = thread_create(alloc_free_func, &thread_data);
+		}
+
+		uint64_t t0 = timer_get_ticks();
+		event_signal(thread_data.start);
+
+		for (int i = 0; i < thread_count; ++i)
+		{
+			thread_destroy(threads[i]);
+		}
+		uint64_t duration_us = timer_ticks_to_us(timer_get_ticks() - t0);
+
+		event_destroy(thread_data.start);
+		heap_destroy(thread_data.heap);
+
+		// One alloc and one free per block.
+		double ops = 2.0 * k_bench_iterations * k_bench_batch_count * thread_count;
+		double ops_per_second = duration_us ? ops * 1000000.0 / duration_us : 0.0;
+		debug_print(k_print_info, "heap_bench threads=%d duration=%lluus ops/sec=%.0f\n",
+			thread_count, duration_us, ops_per_second);
+	}
+}
+
+static void report_commands(const char* name, uint64_t duration_us)
+{
+	double commands = (double)k_bench_frame_count * k_bench_commands_per_frame;
+	double commands_per_second = duration_us ? commands * 1000000.0 / duration_us : 0.0;
+	debug_print(k_print_info, "heap_bench %s duration=%lluus commands/sec=%.0f\n",
+		name, duration_us, commands_per_second);
+}
+
+void heap_bench_render_commands()
+{
+	heap_t* heap = heap_create(2 * 1024 * 1024);
+
+	void* commands[k_bench_commands_per_frame];
+	void* uniforms[k_bench_commands_per_frame];
+
+	uint64_t t0 = timer_get_ticks();
+	for (int frame = 0; frame < k_bench_frame_count; ++frame)
+	{
+		for (int i = 0; i < k_bench_commands_per_frame; ++i)
+		{
+			commands[i] = heap_alloc(heap, k_bench_command_size, 8);
+			uniforms[i] = heap_alloc(heap, k_bench_uniform_size, 8);
+		}
+		for (int i = 0; i < k_bench_commands_per_frame; ++i)
+		{
+			heap_free(heap, uniforms[i]);
+			heap_free(heap, commands[i]);
+		}
+	}
+	report_commands("render_commands_heap", timer_ticks_to_us(timer_get_ticks() - t0));
+
+	arena_t* arena = arena_create(heap, 64 * 1024);
+
+	t0 = timer_get_ticks();
+	for (int frame = 0; frame < k_bench_frame_count; ++frame)
+	{
+		arena_reset(arena);
+		for (int i = 0; i < k_bench_commands_per_frame; ++i)
+		{
+			commands[i] = arena_alloc(arena, k_bench_command_size, 8);
+			uniforms[i] = arena_alloc(arena, k_bench_uniform_size, 8);
+		}
+	}
+	report_commands("render_commands_arena", timer_ticks_to_us(timer_get_ticks() - t0));
+
+	arena_destroy(arena);
+	heap_destroy(heap);
+}
+
+static void* suite_heap_alloc(void* context, size_t size, size_t alignment)
+{
+	return heap_alloc(context, size, alignment);
+}
+
+static void suite_heap_free(void* context, void* address)
+{
+	heap_free(context, address);
+}
+
+static void* suite_system_alloc(void* context, size_t size, size_t alignment)
+{
+	return _aligned_malloc(size, alignment);
+}
+
+static void suite_system_free(void* context, void* address)
+{
+	_aligned_free(address);
+}
+
+static size_t suite_current_rss()
+{
+	PROCESS_MEMORY_COUNTERS counters = { .cb = sizeof(counters) };
+	GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+	return counters.WorkingSetSize;
+}
+
+static void suite_sample_rss(bench_run_t* run)
+{
+	size_t rss = suite_current_rss();
+	if (rss > run->peak_rss)
+	{
+		run->peak_rss = rss;
+	}
+}
+
+static uint32_t suite_random(uint32_t* state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+static void* suite_alloc(bench_run_t* run, size_t size, size_t alignment)
+{
+	uint64_t t0 = timer_get_ticks();
+	void* address = run->allocator->alloc(run->allocator->context, size, alignment);
+	uint64_t t1 = timer_get_ticks();
+	if (run->latency_count < run->latency_capacity)
+	{
+		run->latencies[run->latency_count++] = t1 - t0;
+	}
+
+	// Touch the memory so it counts toward the working set.
+	memset(address, 0xcd, size);
+	return address;
+}
+
+static void suite_free(bench_run_t* run, void* address)
+{
+	uint64_t t0 = timer_get_ticks();
+	run->allocator->free(run->allocator->context, address);
+	uint64_t t1 = timer_get_ticks();
+	if (run->latency_count < run->latency_capacity)
+	{
+		run->latencies[run->latency_count++] = t1 - t0;
+	}
+}
+
+// Small objects that live for one frame, freed while the next frame allocates.
+static uint64_t suite_frame_churn(bench_run_t* run)
+{
+	static void* objects[2][k_suite_objects_per_frame];
+	uint32_t random = 1;
+
+	for (int frame = 0; frame < k_suite_frame_count; ++frame)
+	{
+		void** current = objects[frame & 1];
+		void** previous = objects[(frame & 1) ^ 1];
+		for (int i = 0; i < k_suite_objects_per_frame; ++i)
+		{
+			if (frame > 0)
+			{
+				suite_free(run, previous[i]);
+			}
+			current[i] = suite_alloc(run, 16 + suite_random(&random) % 240, 8);
+		}
+		suite_sample_rss(run);
+	}
+	for (int i = 0; i < k_suite_objects_per_frame; ++i)
+	{
+		suite_free(run, objects[(k_suite_frame_count - 1) & 1][i]);
+	}
+
+	return 2ull * k_suite_frame_count * k_suite_objects_per_frame;
+}
+
+// Random replacement in a live set whose sizes skew small with a long tail.
+static uint64_t suite_mixed_sizes(bench_run_t* run)
+{
+	static void* live[k_suite_mixed_live];
+	memset(live, 0, sizeof(live));
+	uint32_t random = 7;
+	uint64_t ops = 0;
+
+	for (int i = 0; i < k_suite_mixed_ops; ++i)
+	{
+		int slot = suite_random(&random) % k_suite_mixed_live;
+		if (live[slot])
+		{
+			suite_free(run, live[slot]);
+			ops++;
+		}
+
+		uint32_t roll = suite_random(&random) % 100;
+		size_t size;
+		if (roll < 70)
+		{
+			size = 8 + suite_random(&random) % 248;
+		}
+		else if (roll < 95)
+		{
+			size = 256 + suite_random(&random) % 3840;
+		}
+		else
+		{
+			size = 4096 + suite_random(&random) % 61440;
+		}
+		live[slot] = suite_alloc(run, size, 8);
+		ops++;
+
+		if (i % k_suite_rss_interval == 0)
+		{
+			suite_sample_rss(run);
+		}
+	}
+	for (int i = 0; i < k_suite_mixed_live; ++i)
+	{
+		if (live[i])
+		{
+			suite_free(run, live[i]);
+			ops++;
+		}
+	}
+
+	return ops;
+}
+
+// Over-aligned allocations as used for GPU uploads and SIMD data.
+static uint64_t suite_aligned(bench_run_t* run)
+{
+	static void* live[k_suite_aligned_live];
+	uint32_t random = 13;
+
+	for (int i = 0; i < k_suite_aligned_ops; ++i)
+	{
+		int slot = i % k_suite_aligned_live;
+		if (i >= k_suite_aligned_live)
+		{
+			suite_free(run, live[slot]);
+		}
+		size_t alignment = (size_t)32 << (suite_random(&random) % 8);
+		size_t size = 64 + suite_random(&random) % 8128;
+		live[slot] = suite_alloc(run, size, alignment);
+
+		if (i % k_suite_rss_interval == 0)
+		{
+			suite_sample_rss(run);
+		}
+	}
+	for (int i = 0; i < k_suite_aligned_live; ++i)
+	{
+		suite_free(run, live[i]);
+	}
+
+	return 2ull * k_suite_aligned_ops;
+}
+
+typedef struct suite_transfer_t
+{
+	bench_run_t run;
+	queue_t* queue;
+} suite_transfer_t;
+
+static int suite_consumer_func(void* user)
+{
+	suite_transfer_t* transfer = user;
+	void* address;
+	while ((address = queue_pop(transfer->queue)) != NULL)
+	{
+		suite_free(&transfer->run, address);
+	}
+	return 0;
+}
+
+// Blocks allocated on one thread and freed on another, as with fs and net work.
+static uint64_t suite_producer_consumer(bench_run_t* run, heap_t* queue_heap)
+{
+	// The consumer records into the second half of the latency buffer.
+	run->latency_capacity = k_suite_max_latencies / 2;
+	suite_transfer_t transfer =
+	{
+		.run =
+		{
+			.allocator = run->allocator,
+			.latencies = run->latencies + k_suite_max_latencies / 2,
+			.latency_capacity = k_suite_max_latencies - k_suite_max_latencies / 2,
+		},
+		.queue = queue_create(queue_heap, k_suite_transfer_queue_capacity),
+	};
+	thread_t* consumer = thread_create(suite_consumer_func, &transfer);
+
+	uint32_t random = 21;
+	for (int i = 0; i < k_suite_transfer_count; ++i)
+	{
+		queue_push(transfer.queue, suite_alloc(run, 64 + suite_random(&random) % 448, 8));
+		if (i % k_suite_rss_interval == 0)
+		{
+			suite_sample_rss(run);
+		}
+	}
+	queue_push(transfer.queue, NULL);
+	thread_destroy(consumer);
+	queue_destroy(transfer.queue);
+
+	memmove(run->latencies + run->latency_count, transfer.run.latencies, sizeof(uint64_t) * transfer.run.latency_count);
+	run->latency_count += transfer.run.latency_count;
+
+	return 2ull * k_suite_transfer_count;
+}
+
+static int suite_compare_latency(const void* a, const void* b)
+{
+	uint64_t left = *(const uint64_t*)a;
+	uint64_t right = *(const uint64_t*)b;
+	return (left > right) - (left < right);
+}
+
+static void suite_report(const char* pattern, bench_run_t* run, uint64_t ops, uint64_t duration_ticks)
+{
+	qsort(run->latencies, run->latency_count, sizeof(uint64_t), suite_compare_latency);
+
+	uint64_t ticks_per_second = timer_get_ticks_per_second();
+	uint64_t p50_ns = run->latencies[run->latency_count / 2] * 1000000000ull / ticks_per_second;
+	uint64_t p99_ns = run->latencies[(run->latency_count * 99ull) / 100] * 1000000000ull / ticks_per_second;
+	double seconds = (double)duration_ticks / ticks_per_second;
+	double ops_per_second = seconds > 0.0 ? ops / seconds : 0.0;
+	size_t peak_rss = run->peak_rss > run->base_rss ? run->peak_rss - run->base_rss : 0;
+
+	debug_print(k_print_info, "heap_bench %s allocator=%s ops/sec=%.0f p50=%lluns p99=%lluns peak_rss=%zuKB\n",
+		pattern, run->allocator->name, ops_per_second, p50_ns, p99_ns, peak_rss / 1024);
+}
+
+void heap_bench_suite()
+{
+	static const char* k_patterns[] = { "frame_churn", "mixed_sizes", "producer_consumer", "aligned" };
+
+	// Queues and latency buffers come from outside the allocators being measured.
+	heap_t* queue_heap = heap_create(64 * 1024);
+	uint64_t* latencies = vm_alloc(sizeof(uint64_t) * k_suite_max_latencies);
+
+	for (int pattern = 0; pattern < _countof(k_patterns); ++pattern)
+	{
+		heap_t* heap = heap_create(2 * 1024 * 1024);
+		bench_allocator_t allocators[] =
+		{
+			{ .name = "heap", .alloc = suite_heap_alloc, .free = suite_heap_free, .context = heap },
+			{ .name = "system", .alloc = suite_system_alloc, .free = suite_system_free },
+		};
+
+		for (int i = 0; i < _countof(allocators); ++i)
+		{
+			bench_run_t run =
+			{
+				.allocator = &allocators[i],
+				.latencies = latencies,
+				.latency_capacity = k_suite_max_latencies,
+				.base_rss = suite_current_rss(),
+			};
+
+			uint64_t ops = 0;
+			uint64_t t0 = timer_get_ticks();
+			switch (pattern)
+			{
+			case 0: ops = suite_frame_churn(&run); break;
+			case 1: ops = suite_mixed_sizes(&run); break;
+			case 2: ops = suite_producer_consumer(&run, queue_heap); break;
+			case 3: ops = suite_aligned(&run); break;
+			}
+			uint64_t duration_ticks = timer_get_ticks() - t0;
+
+			suite_report(k_patterns[pattern], &run, ops, duration_ticks);
+		}
+
+		heap_destroy(heap);
+	}
+
+	vm_release(latencies, sizeof(uint64_t) * k_suite_max_latencies);
+	heap_destroy(queue_heap);
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+// Heap allocator benchmarks.
+// Results are reported with debug_print.
+
+// Measures heap_alloc/heap_free throughput with 1 to max_threads threads
+// allocating and freeing small blocks concurrently on a shared heap.
+void heap_bench_thread_scaling(int max_threads);
+
+// Measures render command allocation throughput, comparing per-command
+// heap_alloc/heap_free against a per-frame arena_t that is reset in bulk.
+void heap_bench_render_commands();
+
+// Runs allocation patterns (frame churn of small objects, mixed sizes,
+// cross-thread producer/consumer frees, over-aligned blocks) against heap_t
+// and the system allocator. Reports ops/sec, p50/p99 per-op latency and
+// peak working set growth for each. Every op is timed individually, so
+// ops/sec includes timer overhead; compare allocators, not absolute numbers.
+void heap_bench_suite();
@@ -0,0 +1,487 @@
+#include "job.h"
+
+#include "atomic.h"
+#include "debug.h"
+#include "heap.h"
+#include "mutex.h"
+#include "pool.h"
+#include "semaphore.h"
+#include "thread.h"
+
+#include <intrin.h>
+#include <stdint.h>
+#include <string.h>
+
+enum
+{
+	k_max_workers = 64,
+	// Power of two; a push to a full deque runs the job immediately.
+	k_deque_capacity = 4096,
+	k_job_pool_capacity = 1024,
+	// Failed searches for work before an idle worker goes to sleep.
+	k_idle_spin_count = 256,
+	k_cache_line_size = 64,
+};
+
+typedef struct job_t
+{
+	job_function_t function;
+	void* data;
+	job_counter_t* counter;
+	// Next job on a counter's waiter list or on the shared list.
+	struct job_t* next;
+} job_t;
+
+// Chase-Lev work-stealing deque.
+// The owner pushes and pops at bottom; other threads steal at top. Indices
+// only ever increase and are compared by difference, so wrapping is fine.
+typedef struct job_deque_t
+{
+	int top;
+	char top_padding[k_cache_line_size - sizeof(int)];
+	int bottom;
+	char bottom_padding[k_cache_line_size - sizeof(int)];
+	job_t* jobs[k_deque_capacity];
+} job_deque_t;
+
+typedef struct job_worker_t
+{
+	job_system_t* jobs;
+	int index;
+	thread_t* thread;
+} job_worker_t;
+
+typedef struct job_system_t
+{
+	heap_t* heap;
+	object_pool_t* job_pool;
+
+	// Deque 0 belongs to the creating thread, deque i + 1 to worker i.
+	job_deque_t* deques;
+	int deque_count;
+	int thread_ids[k_max_workers + 1];
+
+	job_worker_t workers[k_max_workers];
+	int worker_count;
+
+	// Jobs started by threads without a deque.
+	mutex_t* shared_mutex;
+	job_t* shared_head;
+	job_t* shared_tail;
+	int shared_count;
+
+	semaphore_t* wake;
+	// Sleeping workers not yet woken. A waker claims one by decrementing it
+	// and then releases wake once, so wake never over-counts.
+	int sleeping_count;
+	int quit;
+} job_system_t;
+
+static int worker_thread_func(void* user);
+static void schedule(job_system_t* jobs, job_t* job);
+static void wake_workers(job_system_t* jobs, int count);
+static void cancel_sleep(job_system_t* jobs);
+static void execute(job_system_t* jobs, job_t* job);
+
+static int index_add(int index, int count)
+{
+	return (int)((uint32_t)index + (uint32_t)count);
+}
+
+static int index_distance(int from, int to)
+{
+	return (int)((uint32_t)to - (uint32_t)from);
+}
+
+static bool deque_push(job_deque_t* deque, job_t* job)
+{
+	int bottom = atomic_load_explicit(&deque->bottom, k_atomic_relaxed);
+	int top = atomic_load_explicit(&deque->top, k_atomic_acquire);
+	if (index_distance(top, bottom) >= k_deque_capacity)
+	{
+		return false;
+	}
+	atomic_store_pointer_explicit((void**)&deque->jobs[bottom & (k_deque_capacity - 1)], job, k_atomic_relaxed);
+	atomic_store_explicit(&deque->bottom, index_add(bottom, 1), k_atomic_release);
+	return true;
+}
+
+static job_t* deque_pop(job_deque_t* deque)
+{
+	int bottom = index_add(atomic_load_explicit(&deque->bottom, k_atomic_relaxed), -1);
+	atomic_store_explicit(&deque->bottom, bottom, k_atomic_relaxed);
+	// Thieves must see the claim on the bottom job before it is read here.
+	atomic_thread_fence(k_atomic_seq_cst);
+	int top = atomic_load_explicit(&deque->top, k_atomic_relaxed);
+	int size = index_distance(top, bottom);
+	if (size < 0)
+	{
+		atomic_store_explicit(&deque->bottom, top, k_atomic_relaxed);
+		return NULL;
+	}
+
+	job_t* job = atomic_load_pointer_explicit((void**)&deque->jobs[bottom & (k_deque_capacity - 1)], k_atomic_relaxed);
+	if (size > 0)
+	{
+		return job;
+	}
+
+	// Last job: race thieves for it.
+	if (atomic_compare_and_exchange_explicit(&deque->top, top, index_add(top, 1), k_atomic_seq_cst) != top)
+	{
+		job = NULL;
+	}
+	atomic_store_explicit(&deque->bottom, index_add(top, 1), k_atomic_relaxed);
+	return job;
+}
+
+static job_t* deque_steal(job_deque_t* deque)
+{
+	int top = atomic_load_explicit(&deque->top, k_atomic_acquire);
+	// Pairs with the fence in deque_pop(), so the owner and a thief never
+	// both take the last job.
+	atomic_thread_fence(k_atomic_seq_cst);
+	int bottom = atomic_load_explicit(&deque->bottom, k_atomic_acquire);
+	if (index_distance(top, bottom) <= 0)
+	{
+		return NULL;
+	}
+	job_t* job = atomic_load_pointer_explicit((void**)&deque->jobs[top & (k_deque_capacity - 1)], k_atomic_relaxed);
+	if (atomic_compare_and_exchange_explicit(&deque->top, top, index_add(top, 1), k_atomic_seq_cst) != top)
+	{
+		return NULL;
+	}
+	return job;
+}
+
+// Index of the calling thread's deque, or -1.
+static int find_deque(job_system_t* jobs)
+{
+	int thread_id = get_current_thread_id();
+	for (int i = 0; i < jobs->deque_count; ++i)
+	{
+		if (atomic_load(&jobs->thread_ids[i]) == thread_id)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+static job_t* find_job(job_system_t* jobs, int self)
+{
+	job_t* job = NULL;
+	if (self >= 0 && (job = deque_pop(&jobs->deques[self])) != NULL)
+	{
+		return job;
+	}
+
+	if (atomic_load(&jobs->shared_count) > 0)
+	{
+		mutex_lock(jobs->shared_mutex);
+		job = jobs->shared_head;
+		if (job)
+		{
+			jobs->shared_head = job->next;
+			if (!jobs->shared_head)
+			{
+				jobs->shared_tail = NULL;
+			}
+			atomic_decrement(&jobs->shared_count);
+		}
+		mutex_unlock(jobs->shared_mutex);
+		if (job)
+		{
+			return job;
+		}
+	}
+
+	for (int i = 1; i <= jobs->deque_count; ++i)
+	{
+		int victim = (self + i + jobs->deque_count) % jobs->deque_count;
+		if (victim != self && (job = deque_steal(&jobs->deques[victim])) != NULL)
+		{
+			return job;
+		}
+	}
+	return NULL;
+}
+
+job_system_t* job_system_create(heap_t* heap, int worker_count)
+{
+	job_system_t* jobs = heap_alloc(heap, sizeof(job_system_t), 8);
+	memset(jobs, 0, sizeof(*jobs));
+	jobs->heap = heap;
+	jobs->job_pool = object_pool_create(heap, sizeof(job_t), 8, k_job_pool_capacity);
+	jobs->shared_mutex = mutex_create();
+
+	jobs->worker_count = __max(0, __min(worker_count, k_max_workers));
+	jobs->wake = semaphore_create(0, k_max_workers);
+
+	jobs->deque_count = jobs->worker_count + 1;
+	jobs->deques = heap_alloc(heap, sizeof(job_deque_t) * jobs->deque_count, k_cache_line_size);
+	memset(jobs->deques, 0, sizeof(job_deque_t) * jobs->deque_count);
+	jobs->thread_ids[0] = get_current_thread_id();
+
+	for (int i = 0; i < jobs->worker_count; ++i)
+	{
+		jobs->workers[i].jobs = jobs;
+		jobs->workers[i].index = i + 1;
+		jobs->workers[i].thread = thread_create(worker_thread_func, &jobs->workers[i]);
+	}
+	return jobs;
+}
+
+void job_system_destroy(job_system_t* jobs)
+{
+	// Pairs with the increment a worker makes before it checks quit: either
+	// it sees quit or it is counted here.
+	atomic_store(&jobs->quit, 1);
+	atomic_thread_fence(k_atomic_seq_cst);
+	wake_workers(jobs, jobs->worker_count);
+	for (int i = 0; i < jobs->worker_count; ++i)
+	{
+		thread_destroy(jobs->workers[i].thread);
+	}
+
+	semaphore_destroy(jobs->wake);
+	mutex_destroy(jobs->shared_mutex);
+	object_pool_destroy(jobs->job_pool);
+	heap_free(jobs->heap, jobs->deques);
+	heap_free(jobs->heap, jobs);
+}
+
+int job_system_get_worker_count(job_system_t* jobs)
+{
+	return jobs->worker_count;
+}
+
+static job_t* create_job(job_system_t* jobs, job_function_t function, void* data, job_counter_t* counter)
+{
+	job_t* job = object_pool_alloc(jobs->job_pool);
+	if (!job)
+	{
+		return NULL;
+	}
+	job->function = function;
+	job->data = data;
+	job->counter = counter;
+	job->next = NULL;
+	if (counter)
+	{
+		atomic_increment(&counter->value);
+	}
+	return job;
+}
+
+void job_run(job_system_t* jobs, job_function_t function, void* data, job_counter_t* counter)
+{
+	job_t* job = create_job(jobs, function, data, counter);
+	if (!job)
+	{
+		// Out of memory; run it here rather than drop it.
+		function(data);
+		return;
+	}
+	schedule(jobs, job);
+}
+
+static void release_waiters(job_system_t* jobs, job_counter_t* counter)
+{
+	job_t* job = atomic_exchange_pointer((void**)&counter->waiters, NULL);
+	while (job)
+	{
+		job_t* next = job->next;
+		schedule(jobs, job);
+		job = next;
+	}
+}
+
+void job_run_after(job_system_t* jobs, job_counter_t* dependency, job_function_t function, void* data, job_counter_t* counter)
+{
+	job_t* job = create_job(jobs, function, data, counter);
+	if (!job)
+	{
+		job_wait(jobs, dependency);
+		function(data);
+		return;
+	}
+
+	for (;;)
+	{
+		job->next = atomic_load_pointer((void**)&dependency->waiters);
+		if (atomic_compare_and_exchange_pointer((void**)&dependency->waiters, job->next, job) == job->next)
+		{
+			break;
+		}
+	}
+
+	// The dependency may have finished before the job was added. Whoever
+	// takes the waiter list, here or in the last job, schedules it.
+	if (atomic_load(&dependency->value) == 0)
+	{
+		release_waiters(jobs, dependency);
+	}
+}
+
+bool job_counter_is_done(job_counter_t* counter)
+{
+	// value is read first: a finishing job raises releasing before lowering
+	// value, so this cannot see both at zero while the job still uses the
+	// counter.
+	return atomic_load(&counter->value) == 0 && atomic_load(&counter->releasing) == 0;
+}
+
+void job_wait(job_system_t* jobs, job_counter_t* counter)
+{
+	int self = find_deque(jobs);
+	while (!job_counter_is_done(counter))
+	{
+		job_t* job = find_job(jobs, self);
+		if (job)
+		{
+			execute(jobs, job);
+		}
+		else
+		{
+			_mm_pause();
+		}
+	}
+}
+
+static void schedule(job_system_t* jobs, job_t* job)
+{
+	int self = find_deque(jobs);
+	if (self < 0 || !deque_push(&jobs->deques[self], job))
+	{
+		if (self >= 0)
+		{
+			// Own deque is full; run the job now.
+			execute(jobs, job);
+			return;
+		}
+
+		mutex_lock(jobs->shared_mutex);
+		job->next = NULL;
+		if (jobs->shared_tail)
+		{
+			jobs->shared_tail->next = job;
+		}
+		else
+		{
+			jobs->shared_head = job;
+		}
+		jobs->shared_tail = job;
+		atomic_increment(&jobs->shared_count);
+		mutex_unlock(jobs->shared_mutex);
+	}
+
+	// The fence orders the push before the read, pairing with the increment
+	// a worker makes before its last look for work. Either it sees this job
+	// or we see it sleeping.
+	atomic_thread_fence(k_atomic_seq_cst);
+	wake_workers(jobs, 1);
+}
+
+// Wakes up to count sleeping workers.
+static void wake_workers(job_system_t* jobs, int count)
+{
+	int sleeping_count = atomic_load_explicit(&jobs->sleeping_count, k_atomic_relaxed);
+	while (sleeping_count > 0 && count > 0)
+	{
+		int old_count = atomic_compare_and_exchange(&jobs->sleeping_count, sleeping_count, sleeping_count - 1);
+		if (old_count == sleeping_count)
+		{
+			semaphore_release(jobs->wake);
+			--sleeping_count;
+			--count;
+			continue;
+		}
+		sleeping_count = old_count;
+	}
+}
+
+// Called by a worker that counted itself as sleeping and then found a reason
+// to stay awake.
+static void cancel_sleep(job_system_t* jobs)
+{
+	int sleeping_count = atomic_load(&jobs->sleeping_count);
+	for (;;)
+	{
+		if (sleeping_count == 0)
+		{
+			// A waker already claimed us; take its release so it is not left
+			// over for another worker.
+			semaphore_acquire(jobs->wake);
+			return;
+		}
+		int old_count = atomic_compare_and_exchange(&jobs->sleeping_count, sleeping_count, sleeping_count - 1);
+		if (old_count == sleeping_count)
+		{
+			return;
+		}
+		sleeping_count = old_count;
+	}
+}
+
+static void execute(job_system_t* jobs, job_t* job)
+{
+	job->function(job->data);
+
+	job_counter_t* counter = job->counter;
+	object_pool_free(jobs->job_pool, job);
+
+	if (counter)
+	{
+		// Keep waiters from returning, and the counter alive, until its
+		// dependents are scheduled.
+		atomic_increment(&counter->releasing);
+		if (atomic_decrement(&counter->value) == 1)
+		{
+			release_waiters(jobs, counter);
+		}
+		atomic_decrement(&counter->releasing);
+	}
+}
+
+static int worker_thread_func(void* user)
+{
+	job_worker_t* worker = user;
+	job_system_t* jobs = worker->jobs;
+	atomic_store(&jobs->thread_ids[worker->index], get_current_thread_id());
+
+	int idle_count = 0;
+	while (!atomic_load(&jobs->quit))
+	{
+		job_t* job = find_job(jobs, worker->index);
+		if (job)
+		{
+			execute(jobs, job);
+			idle_count = 0;
+			continue;
+		}
+
+		if (++idle_count < k_idle_spin_count)
+		{
+			_mm_pause();
+			continue;
+		}
+
+		atomic_increment(&jobs->sleeping_count);
+		job = find_job(jobs, worker->index);
+		if (job || atomic_load(&jobs->quit))
+		{
+			cancel_sleep(jobs);
+			if (job)
+			{
+				execute(jobs, job);
+			}
+			idle_count = 0;
+			continue;
+		}
+		// Whoever wakes us has already taken us off sleeping_count.
+		semaphore_acquire(jobs->wake);
+		idle_count = 0;
+	}
+	return 0;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+// Job System
+//
+// Runs small units of work on a fixed pool of worker threads. Each worker
+// owns a work-stealing deque: it pushes and pops its own jobs at one end
+// without locking, and idle workers steal from the other end. Jobs
+// started by other threads go on a shared list. Idle workers sleep until
+// new jobs arrive.
+//
+// Jobs are grouped with counters. Starting a job adds one to its counter
+// and finishing it subtracts one, so a counter reaches zero when its whole
+// group is done. Callers can wait for a counter, running jobs themselves in
+// the meantime, or start a job that runs only once another counter reaches
+// zero.
+
+#include <stdbool.h>
+
+typedef struct heap_t heap_t;
+
+// Handle to a job system.
+typedef struct job_system_t job_system_t;
+
+// Function run by a job.
+typedef void (*job_function_t)(void* data);
+
+// Count of unfinished jobs in a group. Zero-initialize before use and do
+// not move or free it while any of its jobs or dependents are pending.
+typedef struct job_counter_t
+{
+	int value;
+	// Jobs waiting for value to reach zero.
+	struct job_t* waiters;
+	// Finishing jobs still touching the counter.
+	int releasing;
+} job_counter_t;
+
+// Create a job system with worker_count threads.
+// The creating thread gets a deque of its own too, so jobs it starts are
+// cheap to push and it helps run them while waiting.
+job_system_t* job_system_create(heap_t* heap, int worker_count);
+
+// Destroy a job system and stop its threads.
+// Wait for outstanding jobs first; jobs still queued are never run.
+void job_system_destroy(job_system_t* jobs);
+
+// Get the number of worker threads.
+int job_system_get_worker_count(job_system_t* jobs);
+
+// Start running function(data) on some thread.
+// If counter is not NULL, it is incremented now and decremented when the
+// job finishes.
+void job_run(job_system_t* jobs, job_function_t function, void* data, job_counter_t* counter);
+
+// Start running function(data) once dependency reaches zero.
+// Otherwise the same as job_run().
+void job_run_after(job_system_t* jobs, job_counter_t* dependency, job_function_t function, void* data, job_counter_t* counter);
+
+// Determines if every job counted by counter has finished.
+bool job_counter_is_done(job_counter_t* counter);
+
+// Block until every job counted by counter has finished.
+// The calling thread runs queued jobs while it waits.
+void job_wait(job_system_t* jobs, job_counter_t* counter);
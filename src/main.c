@@ -1,7 +1,9 @@
 #include "audio.h"
 #include "debug.h"
+#include "ecs_bench.h"
 #include "fs.h"
 #include "heap.h"
+#include "heap_bench.h"
 #include "raymarch_demo.h"
 #include "simple_game.h"
 #include "render.h"
@@ -10,6 +12,8 @@
 
 #include "cpp_test.h"
 
+#include <string.h>
+
 int main(int argc, const char* argv[])
 {
 	debug_set_print_mask(k_print_info | k_print_warning | k_print_error);
@@ -19,7 +23,39 @@ int main(int argc, const char* argv[])
 
 	cpp_test_function(42);
 
-	heap_t* heap = heap_create(2 * 1024 * 1024);
+	if (argc >= 2 && strcmp(argv[1], "-heap_bench") == 0)
+	{
+		heap_bench_thread_scaling(8);
+		heap_bench_render_commands();
+		heap_bench_suite();
+		return 0;
+	}
+
+	if (argc >= 2 && strcmp(argv[1], "-ecs_bench") == 0)
+	{
+		ecs_bench_spawn_and_query(1000000);
+		return 0;
+	}
+
+	// "-heap_profile <path>" samples allocations and writes a profile on exit.
+	const char* heap_profile_path = NULL;
+	for (int i = 1; i + 1 < argc; ++i)
+	{
+		if (strcmp(argv[i], "-heap_profile") == 0)
+		{
+			heap_profile_path = argv[i + 1];
+		}
+	}
+
+	heap_info_t heap_info =
+	{
+		.grow_increment = 2 * 1024 * 1024,
+#if defined(_DEBUG)
+		.flags = k_heap_flag_capture_stacks,
+#endif
+		.sample_interval = heap_profile_path ? 512 * 1024 : 0,
+	};
+	heap_t* heap = heap_create_with_info(&heap_info);
 	fs_t* fs = fs_create(heap, 8);
 	wm_window_t* window = wm_create(heap);
 	render_t* render = render_create(heap, window);
@@ -40,6 +76,10 @@ int main(int argc, const char* argv[])
 
 	wm_destroy(window);
 	fs_destroy(fs);
+	if (heap_profile_path)
+	{
+		heap_write_profile(heap, heap_profile_path, k_heap_profile_allocated_bytes);
+	}
 	heap_destroy(heap);
 
 	return 0;
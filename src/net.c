@@ -3,7 +3,8 @@
 #include "debug.h"
 #include "heap.h"
 #include "mutex.h"
-#include "queue.h"
+#include "pool.h"
+#include "spsc_queue.h"
 #include "thread.h"
 #include "timer.h"
 
@@ -22,12 +23,15 @@ enum
 	k_max_entity_types = 32,
 	k_max_snapshots = 256,
 	k_max_entities = 32,
+	// Packets per pool slab; the pool holds up to 64 slabs.
+	k_packet_pool_slab_capacity = 128,
+	k_connection_queue_capacity = 3,
 };
 
 typedef struct entity_type_t
 {
-	uint64_t component_mask;
-	uint64_t replicated_component_mask;
+	ecs_mask_t component_mask;
+	ecs_mask_t replicated_component_mask;
 	net_configure_entity_callback_t configure_callback;
 	void* configure_callback_data;
 	size_t replicated_size;
@@ -77,8 +81,13 @@ typedef struct connection_t
 
 	thread_t* send_thread;
 
-	queue_t* send_queue;
-	queue_t* recv_queue;
+	spsc_queue_t* send_queue;
+	spsc_queue_t* recv_queue;
+
+	// Last batch popped off recv_queue, and how far packet_recv got through it.
+	packet_t* recv_packets[k_connection_queue_capacity];
+	int recv_packet_index;
+	int recv_packet_count;
 
 	uint32_t last_recv_ms;
 
@@ -90,6 +99,8 @@ typedef struct net_t
 	heap_t* heap;
 	ecs_t* ecs;
 
+	object_pool_t* packet_pool;
+
 	int sequence;
 
 	SOCKET sock;
@@ -106,6 +117,7 @@ typedef struct net_t
 static int recv_thread_func(void* user);
 static connection_t* find_or_create_connection(net_t* net, const net_address_t* address);
 
+static void destroy_connection(net_t* net, connection_t* connection);
 static void timeout_old_connections(net_t* net);
 static void snapshot_entities(net_t* net);
 static void packet_send(connection_t* connection);
@@ -117,6 +129,7 @@ net_t* net_create(heap_t* heap, ecs_t* ecs)
 	memset(net, 0, sizeof(net_t));
 	net->heap = heap;
 	net->ecs = ecs;
+	net->packet_pool = object_pool_create(heap, sizeof(packet_t), 8, k_packet_pool_slab_capacity);
 
 	WSADATA data;
 	WSAStartup(MAKEWORD(2, 2), &data);
@@ -146,6 +159,7 @@ void net_destroy(net_t* net)
 	thread_destroy(net->recv_thread);
 	WSACleanup();
 	mutex_destroy(net->connections_mutex);
+	object_pool_destroy(net->packet_pool);
 	heap_free(net->heap, net);
 }
 
@@ -179,18 +193,14 @@ void net_disconnect_all(net_t* net)
 		connection_t* c = &net->connections[i];
 		if (c->address.port)
 		{
-			queue_push(c->send_queue, NULL);
-			thread_destroy(c->send_thread);
-			queue_destroy(c->send_queue);
-			queue_destroy(c->recv_queue);
+			destroy_connection(net, c);
 		}
 	}
-	memset(net->connections, 0, sizeof(net->connections));
 
 	mutex_unlock(net->connections_mutex);
 }
 
-void net_state_register_entity_type(net_t* net, int type, uint64_t component_mask, uint64_t replicated_component_mask, net_configure_entity_callback_t configure_callback, void* configure_callback_data)
+void net_state_register_entity_type(net_t* net, int type, ecs_mask_t component_mask, ecs_mask_t replicated_component_mask, net_configure_entity_callback_t configure_callback, void* configure_callback_data)
 {
 	if (type < _countof(net->entity_types))
 	{
@@ -199,12 +209,9 @@ void net_state_register_entity_type(net_t* net, int type, uint64_t component_mas
 		net->entity_types[type].configure_callback = configure_callback;
 		net->entity_types[type].configure_callback_data = configure_callback_data;
 		net->entity_types[type].replicated_size = 0;
-		for (int i = 0; i < sizeof(replicated_component_mask) * 8; ++i)
+		for (int i = ecs_mask_next(replicated_component_mask, 0); i >= 0; i = ecs_mask_next(replicated_component_mask, i + 1))
 		{
-			if (replicated_component_mask & (1ULL << i))
-			{
-				net->entity_types[type].replicated_size += ecs_get_component_type_size(net->ecs, i);
-			}
+			net->entity_types[type].replicated_size += ecs_get_component_type_size(net->ecs, i);
 		}
 	}
 	else
@@ -283,7 +290,7 @@ static int send_thread_func(void* user)
 
 	while (true)
 	{
-		packet_t* packet = queue_pop(connection->send_queue);
+		packet_t* packet = spsc_queue_pop(connection->send_queue);
 		if (!packet)
 		{
 			break;
@@ -293,7 +300,7 @@ static int send_thread_func(void* user)
 			packet->data, packet->size, 0,
 			(struct sockaddr*)&address, sizeof(address));
 
-		heap_free(connection->net->heap, packet);
+		object_pool_free(connection->net->packet_pool, packet);
 
 		if (bytes <= 0)
 		{
@@ -331,8 +338,10 @@ static connection_t* find_or_create_connection(net_t* net, const net_address_t*
 				c->incoming_sequence = -1;
 				c->ack_sequence = -1;
 				c->last_recv_ms = timer_ticks_to_ms(timer_get_ticks());
-				c->send_queue = queue_create(net->heap, 3);
-				c->recv_queue = queue_create(net->heap, 3);
+				c->send_queue = spsc_queue_create(net->heap, k_connection_queue_capacity);
+				c->recv_queue = spsc_queue_create(net->heap, k_connection_queue_capacity);
+				c->recv_packet_index = 0;
+				c->recv_packet_count = 0;
 				c->send_thread = thread_create(send_thread_func, c);
 
 				result = c;
@@ -352,7 +361,19 @@ static int recv_thread_func(void* user)
 
 	while (true)
 	{
-		packet_t* packet = heap_alloc(net->heap, sizeof(packet_t), 8);
+		packet_t* packet = object_pool_alloc(net->packet_pool);
+		if (!packet)
+		{
+			// Every packet is in flight; the main thread has fallen behind.
+			// Read the datagram anyway and drop it.
+			char dropped[k_net_mtu];
+			if (recvfrom(net->sock, dropped, sizeof(dropped), 0, NULL, NULL) <= 0)
+			{
+				break;
+			}
+			debug_print(k_print_warning, "Out of packets, dropping received datagram.\n");
+			continue;
+		}
 
 		struct sockaddr_in address;
 		int address_len = sizeof(address);
@@ -361,7 +382,7 @@ static int recv_thread_func(void* user)
 			(struct sockaddr*)&address, &address_len);
 		if (bytes <= 0)
 		{
-			heap_free(net->heap, packet);
+			object_pool_free(net->packet_pool, packet);
 			break;
 		}
 
@@ -378,17 +399,47 @@ static int recv_thread_func(void* user)
 		if (!connection)
 		{
 			debug_print(k_print_info, "Too many connections!\n");
-			heap_free(net->heap, packet);
+			object_pool_free(net->packet_pool, packet);
 			continue;
 		}
 		connection->last_recv_ms = timer_ticks_to_ms(timer_get_ticks());
 
-		queue_try_push(connection->recv_queue, packet);
+		if (!spsc_queue_try_push(connection->recv_queue, packet))
+		{
+			object_pool_free(net->packet_pool, packet);
+		}
 	}
 
 	return 0;
 }
 
+static void destroy_connection(net_t* net, connection_t* connection)
+{
+	// The send thread sends and frees everything queued ahead of the NULL,
+	// unless a send failed and it stopped early.
+	spsc_queue_push(connection->send_queue, NULL);
+	thread_destroy(connection->send_thread);
+	packet_t* packet;
+	while ((packet = spsc_queue_try_pop(connection->send_queue)) != NULL)
+	{
+		object_pool_free(net->packet_pool, packet);
+	}
+	spsc_queue_destroy(connection->send_queue);
+
+	// Return received packets that packet_recv never got to.
+	for (int i = connection->recv_packet_index; i < connection->recv_packet_count; ++i)
+	{
+		object_pool_free(net->packet_pool, connection->recv_packets[i]);
+	}
+	while ((packet = spsc_queue_try_pop(connection->recv_queue)) != NULL)
+	{
+		object_pool_free(net->packet_pool, packet);
+	}
+	spsc_queue_destroy(connection->recv_queue);
+
+	memset(connection, 0, sizeof(*connection));
+}
+
 static void timeout_old_connections(net_t* net)
 {
 	mutex_lock(net->connections_mutex);
@@ -401,11 +452,7 @@ static void timeout_old_connections(net_t* net)
 		{
 			debug_print(k_print_info, "Disconnecting old connection.\n");
 
-			queue_push(c->send_queue, NULL);
-			thread_destroy(c->send_thread);
-			queue_destroy(c->send_queue);
-			queue_destroy(c->recv_queue);
-			memset(c, 0, sizeof(*c));
+			destroy_connection(net, c);
 		}
 	}
 
@@ -432,16 +479,13 @@ static void snapshot_entities(net_t* net)
 			memcpy(cur, &header, sizeof(header));
 			cur += sizeof(header);
 
-			uint64_t mask = net->entity_types[type].replicated_component_mask;
-			for (int c = 0; c < sizeof(mask) * 8; ++c)
+			ecs_mask_t mask = net->entity_types[type].replicated_component_mask;
+			for (int c = ecs_mask_next(mask, 0); c >= 0; c = ecs_mask_next(mask, c + 1))
 			{
-				if (mask & (1ULL << c))
-				{
-					void* component_data = ecs_entity_get_component(net->ecs, net->entities[i].ref, c, true);
-					size_t component_size = ecs_get_component_type_size(net->ecs, c);
-					memcpy(cur, component_data, component_size);
-					cur += component_size;
-				}
+				const void* component_data = ecs_entity_get_component_read_only(net->ecs, net->entities[i].ref, c, true);
+				size_t component_size = ecs_get_component_type_size(net->ecs, c);
+				memcpy(cur, component_data, component_size);
+				cur += component_size;
 			}
 		}
 	}
@@ -507,7 +551,12 @@ static void packet_send(connection_t* connection)
 {
 	net_t* net = connection->net;
 
-	packet_t* packet = heap_alloc(net->heap, sizeof(packet_t), 8);
+	packet_t* packet = object_pool_alloc(net->packet_pool);
+	if (!packet)
+	{
+		debug_print(k_print_warning, "Out of packets, skipping send.\n");
+		return;
+	}
 
 	packet_header_t header =
 	{
@@ -519,7 +568,7 @@ static void packet_send(connection_t* connection)
 	packet->size = sizeof(header);
 	packet->size += (int)packet_add_entities(connection, &packet->data[packet->size], sizeof(packet->data) - packet->size);
 
-	queue_push(connection->send_queue, packet);
+	spsc_queue_push(connection->send_queue, packet);
 }
 
 static void packet_read_entities(connection_t* connection, char* packet, size_t packet_size)
@@ -567,16 +616,13 @@ static void packet_read_entities(connection_t* connection, char* packet, size_t
 		bool diff = *iter++ != 0;
 		if (diff)
 		{
-			uint64_t mask = net->entity_types[header.type].replicated_component_mask;
-			for (int i = 0; i < sizeof(mask) * 8; ++i)
+			ecs_mask_t mask = net->entity_types[header.type].replicated_component_mask;
+			for (int i = ecs_mask_next(mask, 0); i >= 0; i = ecs_mask_next(mask, i + 1))
 			{
-				if (mask & (1ULL << i))
-				{
-					void* component_data = ecs_entity_get_component(net->ecs, ref, i, true);
-					size_t component_size = ecs_get_component_type_size(net->ecs, i);
-					memcpy(component_data, iter, component_size);
-					iter += component_size;
-				}
+				void* component_data = ecs_entity_get_component(net->ecs, ref, i, true);
+				size_t component_size = ecs_get_component_type_size(net->ecs, i);
+				memcpy(component_data, iter, component_size);
+				iter += component_size;
 			}
 		}
 	}
@@ -600,9 +646,23 @@ static void packet_recv(connection_t* connection)
 
 	while (true)
 	{
-		packet_t* packet = queue_try_pop(connection->recv_queue);
-		if (!packet || !packet->size)
+		if (connection->recv_packet_index == connection->recv_packet_count)
+		{
+			connection->recv_packet_index = 0;
+			connection->recv_packet_count = spsc_queue_try_pop_many(connection->recv_queue,
+				(void**)connection->recv_packets, _countof(connection->recv_packets));
+			if (!connection->recv_packet_count)
+			{
+				break;
+			}
+		}
+
+		// An empty packet ends this update. Whatever was popped after it
+		// waits in recv_packets for the next one.
+		packet_t* packet = connection->recv_packets[connection->recv_packet_index++];
+		if (!packet->size)
 		{
+			object_pool_free(net->packet_pool, packet);
 			break;
 		}
 
@@ -610,6 +670,7 @@ static void packet_recv(connection_t* connection)
 		memcpy(&header, packet->data, sizeof(header));
 		if (header.sequence <= connection->incoming_sequence)
 		{
+			object_pool_free(net->packet_pool, packet);
 			continue;
 		}
 
@@ -618,6 +679,6 @@ static void packet_recv(connection_t* connection)
 
 		packet_read_entities(connection, &packet->data[sizeof(header)], packet->size - sizeof(header));
 
-		heap_free(net->heap, packet);
+		object_pool_free(net->packet_pool, packet);
 	}
 }
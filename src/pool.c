@@ -0,0 +1,179 @@
+#include "pool.h"
+
+#include "atomic.h"
+#include "debug.h"
+#include "heap.h"
+#include "mutex.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+enum
+{
+	k_pool_max_slabs = 64,
+};
+
+typedef struct object_pool_t
+{
+	heap_t* heap;
+	mutex_t* mutex;
+
+	// Each object is preceded by a header holding its index so free can find
+	// it without searching the slabs. stride covers the header and object.
+	size_t header_size;
+	size_t stride;
+	size_t alignment;
+	int capacity;
+
+	int slab_count;
+	char* slabs[k_pool_max_slabs];
+
+	// Head of the free list. The low 32 bits hold the index of the first
+	// free object plus one (zero when empty). The high 32 bits hold a tag
+	// bumped on every change so a stale compare-exchange cannot succeed (ABA).
+	uint64_t free_head;
+} object_pool_t;
+
+static void* index_to_object(object_pool_t* pool, uint32_t index)
+{
+	return pool->slabs[index / pool->capacity] + (index % pool->capacity) * pool->stride + pool->header_size;
+}
+
+static uint32_t object_to_index(object_pool_t* pool, void* object)
+{
+	uint32_t index = ((uint32_t*)object)[-1];
+	if (index >= (uint32_t)(atomic_load(&pool->slab_count) * pool->capacity) || index_to_object(pool, index) != object)
+	{
+		debug_print(k_print_error, "Object was not allocated from this pool.\n");
+		return UINT32_MAX;
+	}
+	return index;
+}
+
+// Each free object stores the index plus one of the next free object in its first bytes.
+static void push_chain(object_pool_t* pool, uint32_t first, uint32_t last)
+{
+	uint32_t* last_link = index_to_object(pool, last);
+	while (true)
+	{
+		uint64_t head = atomic_load64(&pool->free_head);
+		*last_link = (uint32_t)head;
+		uint64_t new_head = (((head >> 32) + 1) << 32) | (first + 1);
+		if (atomic_compare_and_exchange64(&pool->free_head, head, new_head) == head)
+		{
+			break;
+		}
+	}
+}
+
+static bool add_slab(object_pool_t* pool)
+{
+	mutex_lock(pool->mutex);
+
+	// Another thread may have grown the pool while we waited.
+	if ((uint32_t)atomic_load64(&pool->free_head) != 0)
+	{
+		mutex_unlock(pool->mutex);
+		return true;
+	}
+
+	if (pool->slab_count == k_pool_max_slabs)
+	{
+		mutex_unlock(pool->mutex);
+		debug_print(k_print_warning, "Pool out of slabs.\n");
+		return false;
+	}
+
+	char* slab = heap_alloc(pool->heap, pool->capacity * pool->stride, pool->alignment);
+	if (!slab)
+	{
+		mutex_unlock(pool->mutex);
+		return false;
+	}
+
+	uint32_t first = pool->slab_count * pool->capacity;
+	uint32_t last = first + pool->capacity - 1;
+	for (uint32_t i = 0; i < (uint32_t)pool->capacity; ++i)
+	{
+		char* object = slab + i * pool->stride + pool->header_size;
+		((uint32_t*)object)[-1] = first + i;
+		*(uint32_t*)object = i + 1 < (uint32_t)pool->capacity ? first + i + 2 : 0;
+	}
+
+	// Publish the slab before any of its objects can appear on the free list.
+	pool->slabs[pool->slab_count] = slab;
+	atomic_increment(&pool->slab_count);
+
+	push_chain(pool, first, last);
+
+	mutex_unlock(pool->mutex);
+	return true;
+}
+
+object_pool_t* object_pool_create(heap_t* heap, size_t object_size, size_t alignment, int capacity)
+{
+	object_pool_t* pool = heap_alloc(heap, sizeof(object_pool_t), 8);
+	if (!pool)
+	{
+		return NULL;
+	}
+	memset(pool, 0, sizeof(*pool));
+	pool->heap = heap;
+	pool->mutex = mutex_create();
+	pool->alignment = __max(alignment, sizeof(uint32_t));
+	pool->header_size = pool->alignment;
+	pool->stride = pool->header_size + ((__max(object_size, sizeof(uint32_t)) + (pool->alignment - 1)) & ~(pool->alignment - 1));
+	pool->capacity = capacity;
+	return pool;
+}
+
+void object_pool_destroy(object_pool_t* pool)
+{
+	for (int i = 0; i < pool->slab_count; ++i)
+	{
+		heap_free(pool->heap, pool->slabs[i]);
+	}
+	mutex_destroy(pool->mutex);
+	heap_free(pool->heap, pool);
+}
+
+void* object_pool_alloc(object_pool_t* pool)
+{
+	while (true)
+	{
+		uint64_t head = atomic_load64(&pool->free_head);
+		uint32_t index = (uint32_t)head;
+		if (!index)
+		{
+			if (!add_slab(pool))
+			{
+				return NULL;
+			}
+			continue;
+		}
+
+		// The object may be popped and reused by another thread while we read
+		// its link; the tag makes the compare-exchange below fail in that case.
+		void* object = index_to_object(pool, index - 1);
+		uint32_t next = *(volatile uint32_t*)object;
+		uint64_t new_head = (((head >> 32) + 1) << 32) | next;
+		if (atomic_compare_and_exchange64(&pool->free_head, head, new_head) == head)
+		{
+			return object;
+		}
+	}
+}
+
+void object_pool_free(object_pool_t* pool, void* object)
+{
+	if (!object)
+	{
+		return;
+	}
+	uint32_t index = object_to_index(pool, object);
+	if (index != UINT32_MAX)
+	{
+		push_chain(pool, index, index);
+	}
+}
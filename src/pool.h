@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdlib.h>
+
+// Fixed-size Object Pool
+//
+// Main object, object_pool_t, hands out objects of a single size from
+// contiguous slabs allocated from a parent heap_t. Freed objects are kept on
+// an intrusive free list and reused, so allocation and free never touch the
+// heap once the pool is warm. Safe for multiple threads to allocate and
+// free at the same time.
+
+// Handle to an object pool.
+typedef struct object_pool_t object_pool_t;
+
+typedef struct heap_t heap_t;
+
+// Creates a new object pool.
+// Objects are object_size bytes with the given alignment.
+// Memory is taken from the heap in slabs of capacity objects; the pool
+// grows by another slab when it runs out.
+// Returns NULL if the heap is out of memory.
+object_pool_t* object_pool_create(heap_t* heap, size_t object_size, size_t alignment, int capacity);
+
+// Destroys a pool and returns its slabs to the heap.
+// Any objects still allocated from the pool become invalid.
+void object_pool_destroy(object_pool_t* pool);
+
+// Allocates an object from a pool.
+// Returns NULL if the pool cannot grow any further.
+void* object_pool_alloc(object_pool_t* pool);
+
+// Returns an object previously allocated from a pool.
+void object_pool_free(object_pool_t* pool, void* object);
@@ -1,76 +1,315 @@
+#include "queue.h"
+
 #include "atomic.h"
 #include "heap.h"
 #include "semaphore.h"
 
+#include <intrin.h>
+#include <limits.h>
+#include <stdint.h>
+
+enum
+{
+	// Failed attempts before a blocking push or pop goes to sleep.
+	k_spin_count = 128,
+	k_cache_line_size = 64,
+};
+
+// Ring slot. Position p uses slot p % capacity on lap p / capacity, and
+// sequence says whose turn it is: 2 * lap while waiting for that lap's push,
+// 2 * lap + 1 while waiting for its pop. Positions are 64-bit and never wrap
+// in practice, so any capacity works.
+typedef struct queue_slot_t
+{
+	uint64_t sequence;
+	void* item;
+} queue_slot_t;
+
+// Threads sleeping until the queue changes.
+typedef struct queue_waiters_t
+{
+	semaphore_t* semaphore;
+	// Sleepers not yet woken. A waker claims one by decrementing it and then
+	// releases the semaphore once, so the semaphore never over-counts.
+	int count;
+} queue_waiters_t;
+
 typedef struct queue_t
 {
 	heap_t* heap;
-	semaphore_t* used_items;
-	semaphore_t* free_items;
-	void** items;
-	int capacity;
-	int head_index;
-	int tail_index;
+	queue_slot_t* slots;
+	uint64_t capacity;
+	queue_waiters_t push_waiters;
+	queue_waiters_t pop_waiters;
+
+	// Producers and consumers each write their own position; keep them off
+	// each other's cache line.
+	char tail_padding[k_cache_line_size];
+	uint64_t tail_position;
+	char head_padding[k_cache_line_size - sizeof(uint64_t)];
+	uint64_t head_position;
+	char end_padding[k_cache_line_size - sizeof(uint64_t)];
 } queue_t;
 
 queue_t* queue_create(heap_t* heap, int capacity)
 {
-	queue_t* queue = heap_alloc(heap, sizeof(queue_t), 8);
-	queue->items = heap_alloc(heap, sizeof(void*) * capacity, 8);
-	queue->used_items = semaphore_create(0, capacity);
-	queue->free_items = semaphore_create(capacity, capacity);
+	queue_t* queue = heap_alloc(heap, sizeof(queue_t), k_cache_line_size);
 	queue->heap = heap;
 	queue->capacity = capacity;
-	queue->head_index = 0;
-	queue->tail_index = 0;
+	queue->slots = heap_alloc(heap, sizeof(queue_slot_t) * capacity, 8);
+	for (int i = 0; i < capacity; ++i)
+	{
+		queue->slots[i].sequence = 0;
+		queue->slots[i].item = NULL;
+	}
+	queue->push_waiters.semaphore = semaphore_create(0, INT_MAX);
+	queue->push_waiters.count = 0;
+	queue->pop_waiters.semaphore = semaphore_create(0, INT_MAX);
+	queue->pop_waiters.count = 0;
+	queue->tail_position = 0;
+	queue->head_position = 0;
 	return queue;
 }
 
 void queue_destroy(queue_t* queue)
 {
-	semaphore_destroy(queue->used_items);
-	semaphore_destroy(queue->free_items);
-	heap_free(queue->heap, queue->items);
+	semaphore_destroy(queue->push_waiters.semaphore);
+	semaphore_destroy(queue->pop_waiters.semaphore);
+	heap_free(queue->heap, queue->slots);
 	heap_free(queue->heap, queue);
 }
 
+// Claims up to count consecutive slots ready for a push or a pop, starting at
+// the position in next_position. Returns how many were claimed, 0 if none are
+// ready, and writes the first claimed position to position.
+static int claim_slots(queue_t* queue, uint64_t* next_position, int count, uint64_t turn_offset, uint64_t* position)
+{
+	uint64_t first = atomic_load64(next_position);
+	for (;;)
+	{
+		uint64_t lap = first / queue->capacity;
+		uint64_t index = first - lap * queue->capacity;
+		int ready_count = 0;
+		int64_t turn = 0;
+		while (ready_count < count)
+		{
+			turn = (int64_t)(atomic_load64(&queue->slots[index].sequence) - (lap * 2 + turn_offset));
+			if (turn != 0)
+			{
+				break;
+			}
+			++ready_count;
+			if (++index == queue->capacity)
+			{
+				index = 0;
+				++lap;
+			}
+		}
+
+		if (ready_count == 0)
+		{
+			if (turn < 0)
+			{
+				// The first slot is a lap behind: full for a push, empty for a pop.
+				return 0;
+			}
+			// Another thread claimed first already.
+			first = atomic_load64(next_position);
+			continue;
+		}
+
+		uint64_t old_first = atomic_compare_and_exchange64(next_position, first, first + ready_count);
+		if (old_first == first)
+		{
+			*position = first;
+			return ready_count;
+		}
+		first = old_first;
+	}
+}
+
+static int push_items(queue_t* queue, void** items, int count)
+{
+	uint64_t position;
+	int push_count = claim_slots(queue, &queue->tail_position, count, 0, &position);
+	uint64_t lap = position / queue->capacity;
+	uint64_t index = position - lap * queue->capacity;
+	for (int i = 0; i < push_count; ++i)
+	{
+		queue_slot_t* slot = &queue->slots[index];
+		slot->item = items[i];
+		atomic_store64(&slot->sequence, lap * 2 + 1);
+		if (++index == queue->capacity)
+		{
+			index = 0;
+			++lap;
+		}
+	}
+	return push_count;
+}
+
+static int pop_items(queue_t* queue, void** items, int count)
+{
+	uint64_t position;
+	int pop_count = claim_slots(queue, &queue->head_position, count, 1, &position);
+	uint64_t lap = position / queue->capacity;
+	uint64_t index = position - lap * queue->capacity;
+	for (int i = 0; i < pop_count; ++i)
+	{
+		queue_slot_t* slot = &queue->slots[index];
+		items[i] = slot->item;
+		atomic_store64(&slot->sequence, lap * 2 + 2);
+		if (++index == queue->capacity)
+		{
+			index = 0;
+			++lap;
+		}
+	}
+	return pop_count;
+}
+
+// Wakes up to count sleepers.
+static void wake(queue_waiters_t* waiters, int count)
+{
+	if (count == 0)
+	{
+		return;
+	}
+
+	// The compare-exchange orders the caller's push or pop before this read,
+	// pairing with the increment a sleeper makes before its last attempt.
+	// Either the sleeper sees the change or it is counted here.
+	int sleeper_count = atomic_compare_and_exchange(&waiters->count, 0, 0);
+	while (sleeper_count > 0 && count > 0)
+	{
+		int old_count = atomic_compare_and_exchange(&waiters->count, sleeper_count, sleeper_count - 1);
+		if (old_count == sleeper_count)
+		{
+			semaphore_release(waiters->semaphore);
+			--sleeper_count;
+			--count;
+			continue;
+		}
+		sleeper_count = old_count;
+	}
+}
+
+static void begin_sleep(queue_waiters_t* waiters)
+{
+	atomic_increment(&waiters->count);
+}
+
+static void cancel_sleep(queue_waiters_t* waiters)
+{
+	int count = atomic_load(&waiters->count);
+	for (;;)
+	{
+		if (count == 0)
+		{
+			// A waker already claimed us; take its release so it is not left
+			// over for someone else.
+			semaphore_acquire(waiters->semaphore);
+			return;
+		}
+		int old_count = atomic_compare_and_exchange(&waiters->count, count, count - 1);
+		if (old_count == count)
+		{
+			return;
+		}
+		count = old_count;
+	}
+}
+
 void queue_push(queue_t* queue, void* item)
 {
-	semaphore_acquire(queue->free_items);
-	int index = atomic_increment(&queue->tail_index) % queue->capacity;
-	queue->items[index] = item;
-	semaphore_release(queue->used_items);
+	queue_push_many(queue, &item, 1);
 }
 
 void* queue_pop(queue_t* queue)
 {
-	semaphore_acquire(queue->used_items);
-	int index = atomic_increment(&queue->head_index) % queue->capacity;
-	void* item = queue->items[index];
-	semaphore_release(queue->free_items);
+	void* item = NULL;
+	queue_pop_many(queue, &item, 1);
 	return item;
 }
 
 bool queue_try_push(queue_t* queue, void* item)
 {
-	if (semaphore_try_acquire(queue->free_items))
+	return queue_try_push_many(queue, &item, 1) == 1;
+}
+
+void* queue_try_pop(queue_t* queue)
+{
+	void* item = NULL;
+	queue_try_pop_many(queue, &item, 1);
+	return item;
+}
+
+void queue_push_many(queue_t* queue, void** items, int count)
+{
+	int spin = 0;
+	while (count > 0)
 	{
-		int index = atomic_increment(&queue->tail_index) % queue->capacity;
-		queue->items[index] = item;
-		semaphore_release(queue->used_items);
-		return true;
+		int push_count = push_items(queue, items, count);
+		if (push_count == 0)
+		{
+			if (spin++ < k_spin_count)
+			{
+				_mm_pause();
+				continue;
+			}
+			begin_sleep(&queue->push_waiters);
+			push_count = push_items(queue, items, count);
+			if (push_count == 0)
+			{
+				semaphore_acquire(queue->push_waiters.semaphore);
+				continue;
+			}
+			cancel_sleep(&queue->push_waiters);
+		}
+		wake(&queue->pop_waiters, push_count);
+		items += push_count;
+		count -= push_count;
+		spin = 0;
 	}
-	return false;
 }
 
-void* queue_try_pop(queue_t* queue)
+int queue_pop_many(queue_t* queue, void** items, int max_count)
 {
-	if (semaphore_try_acquire(queue->used_items))
+	int spin = 0;
+	for (;;)
 	{
-		int index = atomic_increment(&queue->head_index) % queue->capacity;
-		void* item = queue->items[index];
-		semaphore_release(queue->free_items);
-		return item;
+		int pop_count = pop_items(queue, items, max_count);
+		if (pop_count == 0)
+		{
+			if (spin++ < k_spin_count)
+			{
+				_mm_pause();
+				continue;
+			}
+			begin_sleep(&queue->pop_waiters);
+			pop_count = pop_items(queue, items, max_count);
+			if (pop_count == 0)
+			{
+				semaphore_acquire(queue->pop_waiters.semaphore);
+				continue;
+			}
+			cancel_sleep(&queue->pop_waiters);
+		}
+		wake(&queue->push_waiters, pop_count);
+		return pop_count;
 	}
-	return NULL;
+}
+
+int queue_try_push_many(queue_t* queue, void** items, int count)
+{
+	int push_count = push_items(queue, items, count);
+	wake(&queue->pop_waiters, push_count);
+	return push_count;
+}
+
+int queue_try_pop_many(queue_t* queue, void** items, int max_count)
+{
+	int pop_count = pop_items(queue, items, max_count);
+	wake(&queue->push_waiters, pop_count);
+	return pop_count;
 }
@@ -3,6 +3,10 @@
 #include <stdbool.h>
 
 // Thread-safe Queue container
+//
+// Bounded multi-producer, multi-consumer ring buffer. Pushing and popping
+// take no locks; blocking calls spin briefly and then sleep until another
+// thread pops or pushes.
 
 // Handle to a thread-safe queue.
 typedef struct queue_t queue_t;
@@ -34,3 +38,26 @@ bool queue_try_push(queue_t* queue, void* item);
 // If the queue is empty, returns NULL.
 // Safe for multiple threads to pop at the same time.
 void* queue_try_pop(queue_t* queue);
+
+// Push count items onto a queue, in order.
+// If the queue is full, blocks until space is available. Items pushed by
+// other threads meanwhile may be interleaved, but each run of items that fit
+// at once is claimed with a single synchronization.
+// Safe for multiple threads to push at the same time.
+void queue_push_many(queue_t* queue, void** items, int count);
+
+// Pop up to max_count items off a queue (FIFO order).
+// If the queue is empty, blocks until at least one item is available.
+// Returns the number of items written to items.
+// Safe for multiple threads to pop at the same time.
+int queue_pop_many(queue_t* queue, void** items, int max_count);
+
+// Push as many of count items onto a queue as fit, in order.
+// Returns the number pushed, which is 0 if the queue is full.
+// Safe for multiple threads to push at the same time.
+int queue_try_push_many(queue_t* queue, void** items, int count);
+
+// Pop up to max_count items off a queue (FIFO order).
+// Returns the number of items written to items, which is 0 if the queue is empty.
+// Safe for multiple threads to pop at the same time.
+int queue_try_pop_many(queue_t* queue, void** items, int max_count);
@@ -164,7 +164,7 @@ static void unload_resources(raymarch_demo_t* demo)
 
 static void spawn_camera(raymarch_demo_t* demo)
 {
-	uint64_t k_camera_ent_mask = (1ULL << demo->camera_type);
+	ecs_mask_t k_camera_ent_mask = ecs_mask_of(demo->camera_type);
 	demo->camera_ent = ecs_entity_add(demo->ecs, k_camera_ent_mask);
 
 	camera_component_t* camera_comp = ecs_entity_get_component(demo->ecs, demo->camera_ent, demo->camera_type, true);
@@ -185,7 +185,8 @@ static void spawn_camera(raymarch_demo_t* demo)
 
 static void spawn_screen_quad(raymarch_demo_t* demo)
 {
-	uint64_t k_screen_quad_ent_mask = (1ULL << demo->transform_type) | (1ULL << demo->model_type);
+	ecs_mask_t k_screen_quad_ent_mask = ecs_mask_of(demo->transform_type);
+	ecs_mask_set(&k_screen_quad_ent_mask, demo->model_type);
 	demo->screen_quad_ent = ecs_entity_add(demo->ecs, k_screen_quad_ent_mask);
 
 	transform_component_t* transform_comp = ecs_entity_get_component(demo->ecs, demo->screen_quad_ent, demo->transform_type, true);
@@ -1,9 +1,11 @@
 #include "render.h"
 
+#include "arena.h"
 #include "ecs.h"
 #include "gpu.h"
 #include "heap.h"
-#include "queue.h"
+#include "semaphore.h"
+#include "spsc_queue.h"
 #include "thread.h"
 #include "wm.h"
 
@@ -13,6 +15,17 @@
 enum
 {
 	k_render_max_drawables = 512,
+
+	// Frames in flight are bounded by the frame arenas, so the command queue
+	// only needs to be deep enough that the game thread rarely waits on it.
+	k_render_queue_capacity = 256,
+	// Commands the render thread takes off the queue at once.
+	k_render_command_batch_size = 64,
+
+	// Commands for a frame are allocated from one arena while the render
+	// thread consumes the previous frame's commands from the other.
+	k_render_frame_arena_count = 2,
+	k_render_frame_arena_block_size = 64 * 1024,
 };
 
 typedef enum command_type_t
@@ -64,7 +77,12 @@ typedef struct render_t
 	wm_window_t* window;
 	thread_t* thread;
 	gpu_t* gpu;
-	queue_t* queue;
+	spsc_queue_t* queue;
+
+	arena_t* frame_arenas[k_render_frame_arena_count];
+	semaphore_t* frame_arenas_free;
+	arena_t* push_arena;
+	int push_frame_counter;
 
 	int frame_counter;
 	int gpu_frame_count;
@@ -82,13 +100,21 @@ static draw_shader_t* create_or_get_shader_for_model_command(render_t* render, m
 static draw_mesh_t* create_or_get_mesh_for_model_command(render_t* render, model_command_t* command);
 static draw_instance_t* create_or_get_instance_for_model_command(render_t* render, model_command_t* command, gpu_shader_t* shader);
 static void destroy_stale_data(render_t* render);
+static arena_t* get_push_arena(render_t* render);
 
 render_t* render_create(heap_t* heap, wm_window_t* window)
 {
 	render_t* render = heap_alloc(heap, sizeof(render_t), 8);
 	render->heap = heap;
 	render->window = window;
-	render->queue = queue_create(heap, 3);
+	render->queue = spsc_queue_create(heap, k_render_queue_capacity);
+	for (int i = 0; i < _countof(render->frame_arenas); ++i)
+	{
+		render->frame_arenas[i] = arena_create(heap, k_render_frame_arena_block_size);
+	}
+	render->frame_arenas_free = semaphore_create(k_render_frame_arena_count, k_render_frame_arena_count);
+	render->push_arena = NULL;
+	render->push_frame_counter = 0;
 	render->frame_counter = 0;
 	render->instance_count = 0;
 	render->mesh_count = 0;
@@ -99,30 +125,39 @@ render_t* render_create(heap_t* heap, wm_window_t* window)
 
 void render_destroy(render_t* render)
 {
-	queue_push(render->queue, NULL);
+	spsc_queue_push(render->queue, NULL);
 	thread_destroy(render->thread);
-	queue_destroy(render->queue);
+	spsc_queue_destroy(render->queue);
+	semaphore_destroy(render->frame_arenas_free);
+	for (int i = 0; i < _countof(render->frame_arenas); ++i)
+	{
+		arena_destroy(render->frame_arenas[i]);
+	}
 	heap_free(render->heap, render);
 }
 
 void render_push_model(render_t* render, ecs_entity_ref_t* entity, gpu_mesh_info_t* mesh, gpu_shader_info_t* shader, gpu_uniform_buffer_info_t* uniform)
 {
-	model_command_t* command = heap_alloc(render->heap, sizeof(model_command_t), 8);
+	arena_t* arena = get_push_arena(render);
+	model_command_t* command = arena_alloc(arena, sizeof(model_command_t), 8);
 	command->type = k_command_model;
 	command->entity = *entity;
 	command->mesh = mesh;
 	command->shader = shader;
 	command->uniform_buffer.size = uniform->size;
-	command->uniform_buffer.data = heap_alloc(render->heap, uniform->size, 8);
+	command->uniform_buffer.data = arena_alloc(arena, uniform->size, 8);
 	memcpy(command->uniform_buffer.data, uniform->data, uniform->size);
-	queue_push(render->queue, command);
+	spsc_queue_push(render->queue, command);
 }
 
 void render_push_done(render_t* render)
 {
-	frame_done_command_t* command = heap_alloc(render->heap, sizeof(frame_done_command_t), 8);
+	frame_done_command_t* command = arena_alloc(get_push_arena(render), sizeof(frame_done_command_t), 8);
 	command->type = k_command_frame_done;
-	queue_push(render->queue, command);
+	spsc_queue_push(render->queue, command);
+
+	render->push_arena = NULL;
+	render->push_frame_counter++;
 }
 
 static int render_thread_func(void* user)
@@ -137,54 +172,60 @@ static int render_thread_func(void* user)
 	gpu_mesh_t* last_mesh = NULL;
 	int frame_index = 0;
 
-	while (true)
+	command_type_t* commands[k_render_command_batch_size];
+	bool done = false;
+	while (!done)
 	{
-		command_type_t* type = queue_pop(render->queue);
-		if (!type)
+		int command_count = spsc_queue_pop_many(render->queue, (void**)commands, _countof(commands));
+		for (int i = 0; i < command_count; ++i)
 		{
-			break;
-		}
+			command_type_t* type = commands[i];
+			if (!type)
+			{
+				done = true;
+				break;
+			}
 
-		if (!cmdbuf)
-		{
-			cmdbuf = gpu_frame_begin(render->gpu);
-		}
+			if (!cmdbuf)
+			{
+				cmdbuf = gpu_frame_begin(render->gpu);
+			}
 
-		if (*type == k_command_frame_done)
-		{
-			gpu_frame_end(render->gpu);
-			cmdbuf = NULL;
-			last_pipeline = NULL;
-			last_mesh = NULL;
-
-			destroy_stale_data(render);
-			++render->frame_counter;
-			frame_index = render->frame_counter % render->gpu_frame_count;
-		}
-		else if (*type == k_command_model)
-		{
-			model_command_t* command = (model_command_t*)type;
-			draw_shader_t* shader = create_or_get_shader_for_model_command(render, command);
-			draw_mesh_t* mesh = create_or_get_mesh_for_model_command(render, command);
-			draw_instance_t* instance = create_or_get_instance_for_model_command(render, command, shader->shader);
+			if (*type == k_command_frame_done)
+			{
+				gpu_frame_end(render->gpu);
+				cmdbuf = NULL;
+				last_pipeline = NULL;
+				last_mesh = NULL;
 
-			heap_free(render->heap, command->uniform_buffer.data);
+				destroy_stale_data(render);
+				++render->frame_counter;
+				frame_index = render->frame_counter % render->gpu_frame_count;
 
-			if (last_pipeline != shader->pipeline)
-			{
-				gpu_cmd_pipeline_bind(render->gpu, cmdbuf, shader->pipeline);
-				last_pipeline = shader->pipeline;
+				// All commands of this frame have been consumed; its arena may be reused.
+				semaphore_release(render->frame_arenas_free);
 			}
-			if (last_mesh != mesh->mesh)
+			else if (*type == k_command_model)
 			{
-				gpu_cmd_mesh_bind(render->gpu, cmdbuf, mesh->mesh);
-				last_mesh = mesh->mesh;
+				model_command_t* command = (model_command_t*)type;
+				draw_shader_t* shader = create_or_get_shader_for_model_command(render, command);
+				draw_mesh_t* mesh = create_or_get_mesh_for_model_command(render, command);
+				draw_instance_t* instance = create_or_get_instance_for_model_command(render, command, shader->shader);
+
+				if (last_pipeline != shader->pipeline)
+				{
+					gpu_cmd_pipeline_bind(render->gpu, cmdbuf, shader->pipeline);
+					last_pipeline = shader->pipeline;
+				}
+				if (last_mesh != mesh->mesh)
+				{
+					gpu_cmd_mesh_bind(render->gpu, cmdbuf, mesh->mesh);
+					last_mesh = mesh->mesh;
+				}
+				gpu_cmd_descriptor_bind(render->gpu, cmdbuf, instance->descriptors[frame_index]);
+				gpu_cmd_draw(render->gpu, cmdbuf);
 			}
-			gpu_cmd_descriptor_bind(render->gpu, cmdbuf, instance->descriptors[frame_index]);
-			gpu_cmd_draw(render->gpu, cmdbuf);
 		}
-
-		heap_free(render->heap, type);
 	}
 
 	gpu_wait_until_idle(render->gpu);
@@ -334,3 +375,15 @@ static void destroy_stale_data(render_t* render)
 		}
 	}
 }
+
+static arena_t* get_push_arena(render_t* render)
+{
+	if (!render->push_arena)
+	{
+		// Wait for the render thread to finish the frame that last used this arena.
+		semaphore_acquire(render->frame_arenas_free);
+		render->push_arena = render->frame_arenas[render->push_frame_counter % k_render_frame_arena_count];
+		arena_reset(render->push_arena);
+	}
+	return render->push_arena;
+}
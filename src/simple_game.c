@@ -199,11 +199,10 @@ static void player_net_configure(ecs_t* ecs, ecs_entity_ref_t entity, int type,
 
 static void spawn_player(simple_game_t* game, int index)
 {
-	uint64_t k_player_ent_mask =
-		(1ULL << game->transform_type) |
-		(1ULL << game->model_type) |
-		(1ULL << game->player_type) |
-		(1ULL << game->name_type);
+	ecs_mask_t k_player_ent_mask = ecs_mask_of(game->transform_type);
+	ecs_mask_set(&k_player_ent_mask, game->model_type);
+	ecs_mask_set(&k_player_ent_mask, game->player_type);
+	ecs_mask_set(&k_player_ent_mask, game->name_type);
 	game->player_ent = ecs_entity_add(game->ecs, k_player_ent_mask);
 
 	transform_component_t* transform_comp = ecs_entity_get_component(game->ecs, game->player_ent, game->transform_type, true);
@@ -219,12 +218,10 @@ static void spawn_player(simple_game_t* game, int index)
 	model_comp->mesh_info = &game->cube_mesh;
 	model_comp->shader_info = &game->cube_shader;
 
-	uint64_t k_player_ent_net_mask =
-		(1ULL << game->transform_type) |
-		(1ULL << game->model_type) |
-		(1ULL << game->name_type);
-	uint64_t k_player_ent_rep_mask =
-		(1ULL << game->transform_type);
+	ecs_mask_t k_player_ent_net_mask = ecs_mask_of(game->transform_type);
+	ecs_mask_set(&k_player_ent_net_mask, game->model_type);
+	ecs_mask_set(&k_player_ent_net_mask, game->name_type);
+	ecs_mask_t k_player_ent_rep_mask = ecs_mask_of(game->transform_type);
 	net_state_register_entity_type(game->net, 0, k_player_ent_net_mask, k_player_ent_rep_mask, player_net_configure, game);
 
 	net_state_register_entity_instance(game->net, 0, game->player_ent);
@@ -232,9 +229,8 @@ static void spawn_player(simple_game_t* game, int index)
 
 static void spawn_camera(simple_game_t* game)
 {
-	uint64_t k_camera_ent_mask =
-		(1ULL << game->camera_type) |
-		(1ULL << game->name_type);
+	ecs_mask_t k_camera_ent_mask = ecs_mask_of(game->camera_type);
+	ecs_mask_set(&k_camera_ent_mask, game->name_type);
 	game->camera_ent = ecs_entity_add(game->ecs, k_camera_ent_mask);
 
 	name_component_t* name_comp = ecs_entity_get_component(game->ecs, game->camera_ent, game->name_type, true);
@@ -255,7 +251,8 @@ static void update_players(simple_game_t* game)
 
 	uint32_t key_mask = wm_get_key_mask(game->window);
 
-	uint64_t k_query_mask = (1ULL << game->transform_type) | (1ULL << game->player_type);
+	ecs_mask_t k_query_mask = ecs_mask_of(game->transform_type);
+	ecs_mask_set(&k_query_mask, game->player_type);
 
 	for (ecs_query_t query = ecs_query_create(game->ecs, k_query_mask);
 		ecs_query_is_valid(game->ecs, &query);
@@ -293,14 +290,15 @@ static void update_players(simple_game_t* game)
 
 static void draw_models(simple_game_t* game)
 {
-	uint64_t k_camera_query_mask = (1ULL << game->camera_type);
+	ecs_mask_t k_camera_query_mask = ecs_mask_of(game->camera_type);
 	for (ecs_query_t camera_query = ecs_query_create(game->ecs, k_camera_query_mask);
 		ecs_query_is_valid(game->ecs, &camera_query);
 		ecs_query_next(game->ecs, &camera_query))
 	{
 		camera_component_t* camera_comp = ecs_query_get_component(game->ecs, &camera_query, game->camera_type);
 
-		uint64_t k_model_query_mask = (1ULL << game->transform_type) | (1ULL << game->model_type);
+		ecs_mask_t k_model_query_mask = ecs_mask_of(game->transform_type);
+		ecs_mask_set(&k_model_query_mask, game->model_type);
 		for (ecs_query_t query = ecs_query_create(game->ecs, k_model_query_mask);
 			ecs_query_is_valid(game->ecs, &query);
 			ecs_query_next(game->ecs, &query))
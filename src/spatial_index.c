@@ -0,0 +1,297 @@
+#include "spatial_index.h"
+
+#include "heap.h"
+
+#include <string.h>
+
+enum
+{
+	k_bucket_count = 4096,
+	k_initial_capacity = 256,
+
+	// Entities covering more cells than this are kept on a separate list
+	// tested by every query instead of being binned.
+	k_max_cells_per_entry = 64,
+};
+
+typedef struct spatial_entry_t
+{
+	ecs_entity_ref_t ref;
+	vec3f_t min;
+	vec3f_t max;
+	int min_cell[3];
+} spatial_entry_t;
+
+// One entry's membership in one cell. Cells sharing a bucket are told
+// apart by their coordinates.
+typedef struct spatial_node_t
+{
+	int cell[3];
+	int entry;
+	int next;
+} spatial_node_t;
+
+typedef struct spatial_index_t
+{
+	heap_t* heap;
+	float inv_cell_size;
+
+	spatial_entry_t* entries;
+	int entry_count;
+	int entry_capacity;
+
+	spatial_node_t* nodes;
+	int node_count;
+	int node_capacity;
+
+	// First node of each bucket and of the oversized list, or -1.
+	int buckets[k_bucket_count];
+	int large_head;
+} spatial_index_t;
+
+static bool grow_array(heap_t* heap, void** items, int* capacity, int count, size_t item_size, int required)
+{
+	if (required <= *capacity)
+	{
+		return true;
+	}
+	int new_capacity = *capacity ? *capacity : k_initial_capacity;
+	while (new_capacity < required)
+	{
+		new_capacity *= 2;
+	}
+	void* new_items = heap_alloc(heap, item_size * new_capacity, 8);
+	if (!new_items)
+	{
+		return false;
+	}
+	if (*items)
+	{
+		memcpy(new_items, *items, item_size * count);
+		heap_free(heap, *items);
+	}
+	*items = new_items;
+	*capacity = new_capacity;
+	return true;
+}
+
+static void get_cell(spatial_index_t* index, vec3f_t v, int cell[3])
+{
+	cell[0] = (int)floorf(v.x * index->inv_cell_size);
+	cell[1] = (int)floorf(v.y * index->inv_cell_size);
+	cell[2] = (int)floorf(v.z * index->inv_cell_size);
+}
+
+static int get_bucket(const int cell[3])
+{
+	uint32_t hash = ((uint32_t)cell[0] * 73856093u) ^ ((uint32_t)cell[1] * 19349663u) ^ ((uint32_t)cell[2] * 83492791u);
+	return (int)(hash & (k_bucket_count - 1));
+}
+
+static int64_t get_cell_count(const int min_cell[3], const int max_cell[3])
+{
+	return ((int64_t)max_cell[0] - min_cell[0] + 1) *
+		((int64_t)max_cell[1] - min_cell[1] + 1) *
+		((int64_t)max_cell[2] - min_cell[2] + 1);
+}
+
+spatial_index_t* spatial_index_create(heap_t* heap, float cell_size)
+{
+	spatial_index_t* index = heap_alloc(heap, sizeof(spatial_index_t), 8);
+	memset(index, 0, sizeof(*index));
+	index->heap = heap;
+	index->inv_cell_size = 1.0f / cell_size;
+	spatial_index_clear(index);
+	return index;
+}
+
+void spatial_index_destroy(spatial_index_t* index)
+{
+	heap_free(index->heap, index->entries);
+	heap_free(index->heap, index->nodes);
+	heap_free(index->heap, index);
+}
+
+void spatial_index_clear(spatial_index_t* index)
+{
+	index->entry_count = 0;
+	index->node_count = 0;
+	memset(index->buckets, 0xff, sizeof(index->buckets));
+	index->large_head = -1;
+}
+
+bool spatial_index_insert(spatial_index_t* index, ecs_entity_ref_t ref, vec3f_t min, vec3f_t max)
+{
+	int min_cell[3];
+	int max_cell[3];
+	get_cell(index, min, min_cell);
+	get_cell(index, max, max_cell);
+
+	int64_t cell_count = get_cell_count(min_cell, max_cell);
+	int node_count = cell_count > k_max_cells_per_entry ? 1 : (int)cell_count;
+
+	if (!grow_array(index->heap, (void**)&index->entries, &index->entry_capacity, index->entry_count, sizeof(spatial_entry_t), index->entry_count + 1) ||
+		!grow_array(index->heap, (void**)&index->nodes, &index->node_capacity, index->node_count, sizeof(spatial_node_t), index->node_count + node_count))
+	{
+		return false;
+	}
+
+	int entry_index = index->entry_count++;
+	spatial_entry_t* entry = &index->entries[entry_index];
+	entry->ref = ref;
+	entry->min = min;
+	entry->max = max;
+	memcpy(entry->min_cell, min_cell, sizeof(min_cell));
+
+	if (cell_count > k_max_cells_per_entry)
+	{
+		spatial_node_t* node = &index->nodes[index->node_count];
+		node->entry = entry_index;
+		node->next = index->large_head;
+		index->large_head = index->node_count++;
+		return true;
+	}
+
+	for (int z = min_cell[2]; z <= max_cell[2]; ++z)
+	{
+		for (int y = min_cell[1]; y <= max_cell[1]; ++y)
+		{
+			for (int x = min_cell[0]; x <= max_cell[0]; ++x)
+			{
+				spatial_node_t* node = &index->nodes[index->node_count];
+				node->cell[0] = x;
+				node->cell[1] = y;
+				node->cell[2] = z;
+				node->entry = entry_index;
+				int bucket = get_bucket(node->cell);
+				node->next = index->buckets[bucket];
+				index->buckets[bucket] = index->node_count++;
+			}
+		}
+	}
+	return true;
+}
+
+// Ranges that only touch do not overlap, unless one of them is a single point,
+// so flat bounds such as 2D shapes in a 3D index still find each other.
+static bool ranges_overlap(float a_min, float a_max, float b_min, float b_max)
+{
+	if (a_min == a_max || b_min == b_max)
+	{
+		return a_min <= b_max && b_min <= a_max;
+	}
+	return a_min < b_max && b_min < a_max;
+}
+
+static bool entry_matches(const spatial_entry_t* entry, vec3f_t min, vec3f_t max, const vec3f_t* center, float radius)
+{
+	if (center)
+	{
+		if (entry->min.x > max.x || entry->max.x < min.x ||
+			entry->min.y > max.y || entry->max.y < min.y ||
+			entry->min.z > max.z || entry->max.z < min.z)
+		{
+			return false;
+		}
+
+		// Distance from the center to the nearest point of the box.
+		vec3f_t nearest = vec3f_min(vec3f_max(*center, entry->min), entry->max);
+		vec3f_t offset = vec3f_sub(nearest, *center);
+		return vec3f_dot(offset, offset) <= radius * radius;
+	}
+	return
+		ranges_overlap(entry->min.x, entry->max.x, min.x, max.x) &&
+		ranges_overlap(entry->min.y, entry->max.y, min.y, max.y) &&
+		ranges_overlap(entry->min.z, entry->max.z, min.z, max.z);
+}
+
+static int query(spatial_index_t* index, vec3f_t min, vec3f_t max, const vec3f_t* center, float radius, ecs_entity_ref_t* results, int result_capacity)
+{
+	int count = 0;
+
+	int min_cell[3];
+	int max_cell[3];
+	get_cell(index, min, min_cell);
+	get_cell(index, max, max_cell);
+
+	// A query covering more cells than there are entries is cheaper as a scan.
+	if (get_cell_count(min_cell, max_cell) > index->entry_count)
+	{
+		for (int i = 0; i < index->entry_count; ++i)
+		{
+			if (entry_matches(&index->entries[i], min, max, center, radius))
+			{
+				if (count < result_capacity)
+				{
+					results[count] = index->entries[i].ref;
+				}
+				count++;
+			}
+		}
+		return count;
+	}
+
+	for (int n = index->large_head; n >= 0; n = index->nodes[n].next)
+	{
+		const spatial_entry_t* entry = &index->entries[index->nodes[n].entry];
+		if (entry_matches(entry, min, max, center, radius))
+		{
+			if (count < result_capacity)
+			{
+				results[count] = entry->ref;
+			}
+			count++;
+		}
+	}
+
+	for (int z = min_cell[2]; z <= max_cell[2]; ++z)
+	{
+		for (int y = min_cell[1]; y <= max_cell[1]; ++y)
+		{
+			for (int x = min_cell[0]; x <= max_cell[0]; ++x)
+			{
+				int cell[3] = { x, y, z };
+				for (int n = index->buckets[get_bucket(cell)]; n >= 0; n = index->nodes[n].next)
+				{
+					const spatial_node_t* node = &index->nodes[n];
+					if (node->cell[0] != x || node->cell[1] != y || node->cell[2] != z)
+					{
+						continue;
+					}
+
+					// An entry may share several cells with the query. Report it
+					// only from the first shared cell, so no visited set is needed
+					// and concurrent queries stay read-only.
+					const spatial_entry_t* entry = &index->entries[node->entry];
+					if (x != __max(min_cell[0], entry->min_cell[0]) ||
+						y != __max(min_cell[1], entry->min_cell[1]) ||
+						z != __max(min_cell[2], entry->min_cell[2]))
+					{
+						continue;
+					}
+
+					if (entry_matches(entry, min, max, center, radius))
+					{
+						if (count < result_capacity)
+						{
+							results[count] = entry->ref;
+						}
+						count++;
+					}
+				}
+			}
+		}
+	}
+	return count;
+}
+
+int spatial_index_query_overlap(spatial_index_t* index, vec3f_t min, vec3f_t max, ecs_entity_ref_t* results, int result_capacity)
+{
+	return query(index, min, max, NULL, 0.0f, results, result_capacity);
+}
+
+int spatial_index_query_range(spatial_index_t* index, vec3f_t center, float radius, ecs_entity_ref_t* results, int result_capacity)
+{
+	vec3f_t extent = { .x = radius, .y = radius, .z = radius };
+	return query(index, vec3f_sub(center, extent), vec3f_add(center, extent), &center, radius, results, result_capacity);
+}
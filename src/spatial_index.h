@@ -0,0 +1,46 @@
+#pragma once
+
+// Spatial Index
+//
+// Broad-phase lookup of entities by axis-aligned bounding box. Boxes are
+// binned into a uniform grid of cubic cells hashed into a fixed table, so
+// the cost of a query depends on how many entities are near it rather than
+// on how many exist.
+//
+// The index is meant to be rebuilt each frame: clear it, insert every
+// entity of interest from its transform, then query. Queries do not modify
+// the index, so any number of threads (e.g. systems run by
+// ecs_scheduler_t) may query at once as long as nothing inserts.
+
+#include "ecs.h"
+#include "vec3f.h"
+
+typedef struct heap_t heap_t;
+
+// Handle to a spatial index.
+typedef struct spatial_index_t spatial_index_t;
+
+// Create a spatial index with cubic cells cell_size units wide.
+// Pick a cell size around the size of a typical entity.
+spatial_index_t* spatial_index_create(heap_t* heap, float cell_size);
+
+// Destroy a spatial index.
+void spatial_index_destroy(spatial_index_t* index);
+
+// Remove all entities from the index.
+void spatial_index_clear(spatial_index_t* index);
+
+// Add an entity with bounds [min, max].
+// Returns false if the index could not grow.
+bool spatial_index_insert(spatial_index_t* index, ecs_entity_ref_t ref, vec3f_t min, vec3f_t max);
+
+// Find entities whose bounds overlap [min, max].
+// Bounds that only touch do not overlap. On an axis where either bounds are
+// flat (min equals max), touching counts.
+// Writes up to result_capacity references to results, each entity once.
+// Returns the total number found, which may exceed result_capacity.
+int spatial_index_query_overlap(spatial_index_t* index, vec3f_t min, vec3f_t max, ecs_entity_ref_t* results, int result_capacity);
+
+// Find entities whose bounds are within radius of center.
+// Otherwise the same as spatial_index_query_overlap().
+int spatial_index_query_range(spatial_index_t* index, vec3f_t center, float radius, ecs_entity_ref_t* results, int result_capacity);
@@ -0,0 +1,254 @@
+#include "spsc_queue.h"
+
+#include "atomic.h"
+#include "heap.h"
+#include "semaphore.h"
+
+#include <intrin.h>
+
+enum
+{
+	// Failed attempts before a blocking push or pop goes to sleep.
+	k_spin_count = 128,
+	k_cache_line_size = 64,
+};
+
+typedef struct spsc_queue_t
+{
+	heap_t* heap;
+	void** items;
+	// One more than the capacity; a slot is always left empty so a full
+	// queue can be told apart from an empty one.
+	int slot_count;
+	semaphore_t* producer_wake;
+	semaphore_t* consumer_wake;
+
+	// Set by a side about to sleep. Written rarely and read on every push or
+	// pop, so kept apart from the indices.
+	char sleeping_padding[k_cache_line_size];
+	int producer_sleeping;
+	int consumer_sleeping;
+
+	// Written only by the producer. cached_head is its last look at head.
+	char tail_padding[k_cache_line_size - sizeof(int) * 2];
+	int tail;
+	int cached_head;
+
+	// Written only by the consumer. cached_tail is its last look at tail.
+	char head_padding[k_cache_line_size - sizeof(int) * 2];
+	int head;
+	int cached_tail;
+	char end_padding[k_cache_line_size - sizeof(int) * 2];
+} spsc_queue_t;
+
+spsc_queue_t* spsc_queue_create(heap_t* heap, int capacity)
+{
+	spsc_queue_t* queue = heap_alloc(heap, sizeof(spsc_queue_t), k_cache_line_size);
+	queue->heap = heap;
+	queue->slot_count = capacity + 1;
+	queue->items = heap_alloc(heap, sizeof(void*) * queue->slot_count, 8);
+	queue->producer_wake = semaphore_create(0, 1);
+	queue->consumer_wake = semaphore_create(0, 1);
+	queue->producer_sleeping = 0;
+	queue->consumer_sleeping = 0;
+	queue->tail = 0;
+	queue->cached_head = 0;
+	queue->head = 0;
+	queue->cached_tail = 0;
+	return queue;
+}
+
+void spsc_queue_destroy(spsc_queue_t* queue)
+{
+	semaphore_destroy(queue->producer_wake);
+	semaphore_destroy(queue->consumer_wake);
+	heap_free(queue->heap, queue->items);
+	heap_free(queue->heap, queue);
+}
+
+// Number of slots from index from up to index to, going forward.
+static int get_distance(spsc_queue_t* queue, int from, int to)
+{
+	int distance = to - from;
+	return distance < 0 ? distance + queue->slot_count : distance;
+}
+
+static int push_items(spsc_queue_t* queue, void** items, int count)
+{
+	int tail = queue->tail;
+	int free_count = queue->slot_count - 1 - get_distance(queue, queue->cached_head, tail);
+	if (free_count < count)
+	{
+		queue->cached_head = atomic_load(&queue->head);
+		free_count = queue->slot_count - 1 - get_distance(queue, queue->cached_head, tail);
+	}
+
+	int push_count = __min(count, free_count);
+	if (push_count > 0)
+	{
+		for (int i = 0; i < push_count; ++i)
+		{
+			queue->items[tail] = items[i];
+			if (++tail == queue->slot_count)
+			{
+				tail = 0;
+			}
+		}
+		atomic_store(&queue->tail, tail);
+	}
+	return push_count;
+}
+
+static int pop_items(spsc_queue_t* queue, void** items, int count)
+{
+	int head = queue->head;
+	int used_count = get_distance(queue, head, queue->cached_tail);
+	if (used_count < count)
+	{
+		queue->cached_tail = atomic_load(&queue->tail);
+		used_count = get_distance(queue, head, queue->cached_tail);
+	}
+
+	int pop_count = __min(count, used_count);
+	if (pop_count > 0)
+	{
+		for (int i = 0; i < pop_count; ++i)
+		{
+			items[i] = queue->items[head];
+			if (++head == queue->slot_count)
+			{
+				head = 0;
+			}
+		}
+		atomic_store(&queue->head, head);
+	}
+	return pop_count;
+}
+
+// Called after a push or pop to wake the other side if it sleeps. The light
+// barrier pairs with the heavy one in begin_sleep(): either the sleeper's last
+// attempt sees our change or we see its flag.
+static void wake(int* sleeping, semaphore_t* semaphore)
+{
+	atomic_light_barrier();
+	if (atomic_load(sleeping) && atomic_compare_and_exchange(sleeping, 1, 0) == 1)
+	{
+		semaphore_release(semaphore);
+	}
+}
+
+static void begin_sleep(int* sleeping)
+{
+	atomic_store(sleeping, 1);
+	atomic_heavy_barrier();
+}
+
+static void cancel_sleep(int* sleeping, semaphore_t* semaphore)
+{
+	if (atomic_compare_and_exchange(sleeping, 1, 0) == 0)
+	{
+		// The other side already cleared the flag and is releasing; take it so
+		// the next sleep does not return early.
+		semaphore_acquire(semaphore);
+	}
+}
+
+void spsc_queue_push(spsc_queue_t* queue, void* item)
+{
+	spsc_queue_push_many(queue, &item, 1);
+}
+
+void* spsc_queue_pop(spsc_queue_t* queue)
+{
+	void* item = NULL;
+	spsc_queue_pop_many(queue, &item, 1);
+	return item;
+}
+
+bool spsc_queue_try_push(spsc_queue_t* queue, void* item)
+{
+	return spsc_queue_try_push_many(queue, &item, 1) == 1;
+}
+
+void* spsc_queue_try_pop(spsc_queue_t* queue)
+{
+	void* item = NULL;
+	spsc_queue_try_pop_many(queue, &item, 1);
+	return item;
+}
+
+void spsc_queue_push_many(spsc_queue_t* queue, void** items, int count)
+{
+	int spin = 0;
+	while (count > 0)
+	{
+		int push_count = push_items(queue, items, count);
+		if (push_count == 0)
+		{
+			if (spin++ < k_spin_count)
+			{
+				_mm_pause();
+				continue;
+			}
+			begin_sleep(&queue->producer_sleeping);
+			push_count = push_items(queue, items, count);
+			if (push_count == 0)
+			{
+				semaphore_acquire(queue->producer_wake);
+				continue;
+			}
+			cancel_sleep(&queue->producer_sleeping, queue->producer_wake);
+		}
+		wake(&queue->consumer_sleeping, queue->consumer_wake);
+		items += push_count;
+		count -= push_count;
+		spin = 0;
+	}
+}
+
+int spsc_queue_pop_many(spsc_queue_t* queue, void** items, int max_count)
+{
+	int spin = 0;
+	for (;;)
+	{
+		int pop_count = pop_items(queue, items, max_count);
+		if (pop_count == 0)
+		{
+			if (spin++ < k_spin_count)
+			{
+				_mm_pause();
+				continue;
+			}
+			begin_sleep(&queue->consumer_sleeping);
+			pop_count = pop_items(queue, items, max_count);
+			if (pop_count == 0)
+			{
+				semaphore_acquire(queue->consumer_wake);
+				continue;
+			}
+			cancel_sleep(&queue->consumer_sleeping, queue->consumer_wake);
+		}
+		wake(&queue->producer_sleeping, queue->producer_wake);
+		return pop_count;
+	}
+}
+
+int spsc_queue_try_push_many(spsc_queue_t* queue, void** items, int count)
+{
+	int push_count = push_items(queue, items, count);
+	if (push_count > 0)
+	{
+		wake(&queue->consumer_sleeping, queue->consumer_wake);
+	}
+	return push_count;
+}
+
+int spsc_queue_try_pop_many(spsc_queue_t* queue, void** items, int max_count)
+{
+	int pop_count = pop_items(queue, items, max_count);
+	if (pop_count > 0)
+	{
+		wake(&queue->producer_sleeping, queue->producer_wake);
+	}
+	return pop_count;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Single-producer, single-consumer Queue container
+//
+// Same interface as queue_t, but only one thread may push and only one
+// thread may pop. In exchange, pushing and popping cost a couple of plain
+// reads and writes: each side keeps its index on its own cache line and no
+// atomic read-modify-write is needed unless the other side is asleep.
+
+// Handle to a single-producer, single-consumer queue.
+typedef struct spsc_queue_t spsc_queue_t;
+
+typedef struct heap_t heap_t;
+
+// Create a queue with the defined capacity.
+spsc_queue_t* spsc_queue_create(heap_t* heap, int capacity);
+
+// Destroy a previously created queue.
+void spsc_queue_destroy(spsc_queue_t* queue);
+
+// Push an item onto a queue.
+// If the queue is full, blocks until space is available.
+// Only the producer thread may push.
+void spsc_queue_push(spsc_queue_t* queue, void* item);
+
+// Pop an item off a queue (FIFO order).
+// If the queue is empty, blocks until an item is available.
+// Only the consumer thread may pop.
+void* spsc_queue_pop(spsc_queue_t* queue);
+
+// Push an item onto a queue if space is available.
+// If the queue is full, returns false.
+// Only the producer thread may push.
+bool spsc_queue_try_push(spsc_queue_t* queue, void* item);
+
+// Pop an item off a queue (FIFO order).
+// If the queue is empty, returns NULL.
+// Only the consumer thread may pop.
+void* spsc_queue_try_pop(spsc_queue_t* queue);
+
+// Push count items onto a queue, in order.
+// If the queue is full, blocks until space is available. Each run of items
+// that fit at once is published with a single write.
+// Only the producer thread may push.
+void spsc_queue_push_many(spsc_queue_t* queue, void** items, int count);
+
+// Pop up to max_count items off a queue (FIFO order).
+// If the queue is empty, blocks until at least one item is available.
+// Returns the number of items written to items.
+// Only the consumer thread may pop.
+int spsc_queue_pop_many(spsc_queue_t* queue, void** items, int max_count);
+
+// Push as many of count items onto a queue as fit, in order.
+// Returns the number pushed, which is 0 if the queue is full.
+// Only the producer thread may push.
+int spsc_queue_try_push_many(spsc_queue_t* queue, void** items, int count);
+
+// Pop up to max_count items off a queue (FIFO order).
+// Returns the number of items written to items, which is 0 if the queue is empty.
+// Only the consumer thread may pop.
+int spsc_queue_try_pop_many(spsc_queue_t* queue, void** items, int max_count);
@@ -929,6 +929,26 @@ size_t tlsf_block_size(void* ptr)
 	return size;
 }
 
+size_t tlsf_largest_free_block(tlsf_t tlsf)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	size_t largest = 0;
+
+	/* The highest non-empty free list holds the largest blocks. */
+	const int fl = tlsf_fls(control->fl_bitmap);
+	if (fl >= 0)
+	{
+		const int sl = tlsf_fls(control->sl_bitmap[fl]);
+		const block_header_t* block = control->blocks[fl][sl];
+		while (block != &control->block_null)
+		{
+			largest = tlsf_max(largest, block_size(block));
+			block = block->next_free;
+		}
+	}
+	return largest;
+}
+
 int tlsf_check_pool(pool_t pool)
 {
 	/* Check that the blocks are physically correct. */
@@ -992,7 +1012,7 @@ pool_t tlsf_add_pool(tlsf_t tlsf, void* mem, size_t bytes)
 		return 0;
 	}
 
-	if (pool_bytes < block_size_min || pool_bytes > block_size_max)
+	if (pool_bytes < block_size_min || pool_bytes >= block_size_max)
 	{
 #if defined (TLSF_64BIT)
 		printf("tlsf_add_pool: Memory size must be between 0x%x and 0x%x00 bytes.\n", 
@@ -1041,6 +1061,50 @@ void tlsf_remove_pool(tlsf_t tlsf, pool_t pool)
 	remove_free_block(control, block, fl, sl);
 }
 
+int tlsf_extend_pool(tlsf_t tlsf, pool_t pool, size_t pool_bytes, size_t bytes)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	const size_t pool_overhead = tlsf_pool_overhead();
+	void* pool_end = tlsf_cast(char*, pool) + pool_bytes;
+
+	/*
+	** The zero-size sentinel occupies the last two header words of the pool.
+	** Turn it into a free block spanning the new memory, place a new sentinel
+	** at the new end, and merge with the previous block if it is free.
+	*/
+	block_header_t* block = offset_to_block(pool_end, -(tlsfptr_t)(2 * block_header_overhead));
+	block_header_t* next;
+
+	tlsf_assert(!block_is_free(block) && block_size(block) == 0 && "pool_end must be the end of a pool");
+	tlsf_assert(bytes % ALIGN_SIZE == 0 && "extension must be aligned");
+
+	/* Once everything in the pool is freed, it coalesces into one block. */
+	if (align_down(pool_bytes + bytes - pool_overhead, ALIGN_SIZE) >= block_size_max)
+	{
+		printf("tlsf_extend_pool: Pool size must be less than 0x%llx bytes.\n",
+			(unsigned long long)(pool_overhead + block_size_max));
+		return 0;
+	}
+
+	block_set_size(block, bytes - block_header_overhead);
+
+	next = block_link_next(block);
+	block_set_size(next, 0);
+	block_set_used(next);
+
+	block_mark_as_free(block);
+	block = block_merge_prev(control, block);
+	block_insert(control, block);
+	return 1;
+}
+
+int tlsf_pool_is_empty(pool_t pool)
+{
+	/* An empty pool is a single free block followed by the sentinel. */
+	block_header_t* block = offset_to_block(pool, -(int)block_header_overhead);
+	return block_is_free(block) && block_size(block_next(block)) == 0;
+}
+
 /*
 ** TLSF main interface.
 */
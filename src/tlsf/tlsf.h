@@ -58,6 +58,16 @@ pool_t tlsf_get_pool(tlsf_t tlsf);
 /* Add/remove memory pools. */
 pool_t tlsf_add_pool(tlsf_t tlsf, void* mem, size_t bytes);
 void tlsf_remove_pool(tlsf_t tlsf, pool_t pool);
+/*
+** Grow a pool that currently spans pool_bytes by bytes of memory starting
+** exactly at its end. The pool must have been added with a size that is a
+** multiple of tlsf_align_size(), and bytes must be one too.
+** Returns zero, leaving the pool unchanged, if the grown pool would exceed
+** the size limit tlsf_add_pool() enforces.
+*/
+int tlsf_extend_pool(tlsf_t tlsf, pool_t pool, size_t pool_bytes, size_t bytes);
+/* Returns nonzero if a pool holds no allocated blocks and may be removed. */
+int tlsf_pool_is_empty(pool_t pool);
 
 /* malloc/memalign/realloc/free replacements. */
 void* tlsf_malloc(tlsf_t tlsf, size_t bytes);
@@ -68,6 +78,9 @@ void tlsf_free(tlsf_t tlsf, void* ptr);
 /* Returns internal block size, not original request size */
 size_t tlsf_block_size(void* ptr);
 
+/* Returns the size of the largest free block across all pools. */
+size_t tlsf_largest_free_block(tlsf_t tlsf);
+
 /* Overheads/limits of internal structures. */
 size_t tlsf_size(void);
 size_t tlsf_align_size(void);
@@ -0,0 +1,79 @@
+#include "vm.h"
+
+#if defined(_WIN32)
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+size_t vm_page_size()
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwPageSize;
+}
+
+void* vm_reserve(size_t size)
+{
+	return VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+}
+
+void* vm_alloc(size_t size)
+{
+	return VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+}
+
+bool vm_commit(void* address, size_t size)
+{
+	return VirtualAlloc(address, size, MEM_COMMIT, PAGE_READWRITE) != NULL;
+}
+
+void vm_decommit(void* address, size_t size)
+{
+	VirtualFree(address, size, MEM_DECOMMIT);
+}
+
+void vm_release(void* address, size_t size)
+{
+	VirtualFree(address, 0, MEM_RELEASE);
+}
+
+#else
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+size_t vm_page_size()
+{
+	return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+void* vm_reserve(size_t size)
+{
+	void* address = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	return address == MAP_FAILED ? NULL : address;
+}
+
+void* vm_alloc(size_t size)
+{
+	void* address = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return address == MAP_FAILED ? NULL : address;
+}
+
+bool vm_commit(void* address, size_t size)
+{
+	return mprotect(address, size, PROT_READ | PROT_WRITE) == 0;
+}
+
+void vm_decommit(void* address, size_t size)
+{
+	// Drop the pages so they read back as zero, then make the range inaccessible again.
+	madvise(address, size, MADV_DONTNEED);
+	mprotect(address, size, PROT_NONE);
+}
+
+void vm_release(void* address, size_t size)
+{
+	munmap(address, size);
+}
+
+#endif
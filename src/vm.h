@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+// Virtual Memory
+//
+// Thin wrapper over the OS virtual memory API.
+// Address space can be reserved up front and backed with memory
+// (committed) in page-sized steps later. New pages are zero-filled.
+
+// Returns the OS page size. Sizes passed to vm functions should be multiples of it.
+size_t vm_page_size();
+
+// Reserves a range of address space without backing memory.
+// Returns NULL on failure.
+void* vm_reserve(size_t size);
+
+// Reserves and commits a range of memory.
+// Returns NULL on failure.
+void* vm_alloc(size_t size);
+
+// Backs part of a reserved range with readable, writable memory.
+bool vm_commit(void* address, size_t size);
+
+// Returns the memory backing part of a range to the OS.
+// The address range stays reserved and may be committed again.
+void vm_decommit(void* address, size_t size);
+
+// Releases a range returned by vm_reserve() or vm_alloc().
+// Size must match the size it was created with.
+void vm_release(void* address, size_t size);